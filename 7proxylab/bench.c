@@ -0,0 +1,645 @@
+/*
+ * bench.c - load generator for the proxy
+ *
+ * It starts a local origin serving static objects, starts the proxy in
+ * front of it, and drives the proxy with a number of keep-alive client
+ * connections. URLs are picked with Zipfian popularity, and each URL has
+ * a size drawn from a weighted mix. At the end it reports throughput,
+ * latency percentiles and the hit ratio, followed by the proxy's own
+ * counters from its stats endpoint.
+ *
+ * With -R it compares the relay paths of the proxy: the origin marks
+ * every response no-store, so each body is relayed rather than cached,
+ * and the same load runs twice, once as the proxy relays by default and
+ * once with -u, through io_uring. The bodies are checked byte by byte.
+ *
+ * build: gcc -O2 -o bench bench.c csapp.c -lpthread -lm
+ * e.g.   ./bench -c 32 -n 100000 -u 5000 -z 0.9 -x "-p sieve -a"
+ *        ./bench -R -m 262144:1 -n 5000
+ */
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <netinet/tcp.h>
+
+#define DEFAULT_CONNS 16
+#define DEFAULT_REQUESTS 20000
+#define DEFAULT_URLS 1000
+#define DEFAULT_ZIPF 0.99
+#define DEFAULT_PORT 18100
+#define DEFAULT_MIX "1024:50,16384:35,65536:10,262144:5"
+
+//max number of sizes in the mix
+#define MAX_SIZES 16
+
+//latency histograms, in microseconds, are log-linear as in proxy.c
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct bc{
+	//the configuration of a run
+
+	char *proxyPath;
+	char *proxyArgs;
+	int conns;
+	long requests;
+	long warmup;
+	int urls;
+	double zipf;
+	int port;
+	int sizes[MAX_SIZES];
+	int weights[MAX_SIZES];
+	int nSizes;
+	int direct;
+	int relay;
+
+};
+
+typedef struct bc benchConfig;
+
+struct bt{
+	//a client thread: its connection count, the counts of its requests,
+	//and the histogram of their latencies
+
+	pthread_t tid;
+	unsigned long seed;
+	long done, errors;
+	unsigned long bytes;
+	unsigned long hist[HIST_BUCKETS];
+
+};
+
+typedef struct bt benchThread;
+
+benchConfig config;
+
+//the cumulative popularity of the URLs, and the size of each
+double *zipfCdf;
+int *urlSize;
+
+//requests handed out so far, shared by the client threads
+long issued = 0;
+
+//the number of requests that reached the origin, in memory shared with it
+long *originRequests;
+
+unsigned long nowUsec(){
+	//the current time in microseconds, from the monotonic clock
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned long nextRandom(unsigned long *state){
+	//xorshift64*, a fast generator good enough for picking URLs
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717UL;
+}
+
+double nextUniform(unsigned long *state){
+	//a uniform number in [0, 1)
+	return (nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int histBucket(unsigned long v){
+	//the bucket of v in a histogram
+	if(v >= (1UL << HIST_MAX_BITS)){
+		v = (1UL << HIST_MAX_BITS) - 1;
+	}
+	if(v < HIST_SUB){
+		return v;
+	}
+	int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
+
+unsigned long histValue(int bucket){
+	//the largest value falling into bucket
+	if(bucket < HIST_SUB){
+		return bucket;
+	}
+	int shift = bucket / HIST_SUB - 1;
+	return ((unsigned long)(bucket - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+unsigned long histPercentile(unsigned long *hist, unsigned long count, double pct){
+	//the value under which pct percent of the count values in hist fall
+	unsigned long want = (unsigned long)(count * pct / 100.0 + 0.5), seen = 0;
+	int i;
+	if(want == 0){
+		want = 1;
+	}
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += hist[i];
+		if(seen >= want){
+			return histValue(i);
+		}
+	}
+	return histValue(HIST_BUCKETS - 1);
+}
+
+int parseMix(char *mix){
+	//parse a mix of sizes like "1024:50,65536:10" into config
+	//return 0 on success, -1 if it is malformed
+	char *p = mix;
+	config.nSizes = 0;
+	while(*p != '\0' && config.nSizes < MAX_SIZES){
+		int size, weight, used;
+		if(sscanf(p, "%d:%d%n", &size, &weight, &used) != 2 || size < 0 || weight <= 0){
+			return -1;
+		}
+		config.sizes[config.nSizes] = size;
+		config.weights[config.nSizes] = weight;
+		config.nSizes++;
+		p += used;
+		if(*p == ','){
+			p++;
+		}
+	}
+	return (config.nSizes > 0 && *p == '\0') ? 0 : -1;
+}
+
+void setupUrls(){
+	//the cumulative Zipfian popularity of the URLs, the first being the
+	//most popular, and a size from the mix for each
+	//sizes are drawn from a fixed seed, so runs are comparable
+	int i, j, total = 0;
+	double sum = 0;
+	unsigned long seed = 88172645463325252UL;
+	zipfCdf = Malloc(config.urls * sizeof(double));
+	urlSize = Malloc(config.urls * sizeof(int));
+	for(i = 0; i < config.urls; i++){
+		sum += 1.0 / pow(i + 1, config.zipf);
+		zipfCdf[i] = sum;
+	}
+	for(i = 0; i < config.urls; i++){
+		zipfCdf[i] /= sum;
+	}
+	for(j = 0; j < config.nSizes; j++){
+		total += config.weights[j];
+	}
+	for(i = 0; i < config.urls; i++){
+		int pick = nextRandom(&seed) % total;
+		for(j = 0; pick >= config.weights[j]; j++){
+			pick -= config.weights[j];
+		}
+		urlSize[i] = config.sizes[j];
+	}
+}
+
+int pickUrl(unsigned long *seed){
+	//pick a URL by its popularity, by binary search in the cumulative one
+	double u = nextUniform(seed);
+	int lo = 0, hi = config.urls - 1;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(zipfCdf[mid] < u){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+//the bodies of the origin's objects are made of this
+char filler[65536];
+
+void noDelay(int fd){
+	//send small writes at once: the origin writes a head and then a
+	//body, which Nagle's algorithm would hold for a delayed ack
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+void* originConn(void *vargp){
+	//serve the requests of a connection to the origin, kept alive until
+	//the peer closes it
+	//the path of an object, /o/<id>/<size>, says how large it is, and the
+	//body is that many bytes of filler
+	int connFd = *((int*)vargp);
+	free(vargp);
+	Pthread_detach(Pthread_self());
+	noDelay(connFd);
+	char buf[MAXLINE], head[MAXLINE];
+	rio_t rio;
+	rio_readinitb(&rio, connFd);
+	while(1){
+		int id, size, keepAlive = 1, eof = 0;
+		if(rio_readlineb(&rio, buf, MAXLINE) <= 0){
+			break;
+		}
+		if(sscanf(buf, "GET /o/%d/%d", &id, &size) != 2){
+			size = -1;
+		}
+		do{
+			if(rio_readlineb(&rio, buf, MAXLINE) <= 0){
+				eof = 1;
+				break;
+			}
+			if(strncasecmp(buf, "Connection:", 11) == 0 && strcasestr(buf, "close") != NULL){
+				keepAlive = 0;
+			}
+		}while(strcmp(buf, "\r\n") != 0);
+		if(eof){
+			break;
+		}
+		__atomic_add_fetch(originRequests, 1, __ATOMIC_RELAXED);
+		if(size < 0){
+			sprintf(head, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+			size = 0;
+		}
+		else{
+			sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %d\r\n%s%s\r\n",
+				size, config.relay ? "Cache-Control: no-store\r\n" : "", keepAlive ? "" : "Connection: close\r\n");
+		}
+		if(rio_writen(connFd, head, strlen(head)) < 0){
+			break;
+		}
+		while(size > 0){
+			int n = (size < (int)sizeof(filler)) ? size : (int)sizeof(filler);
+			if(rio_writen(connFd, filler, n) < 0){
+				break;
+			}
+			size -= n;
+		}
+		if(size > 0 || !keepAlive){
+			break;
+		}
+	}
+	close(connFd);
+	return NULL;
+}
+
+void runOrigin(int port){
+	//the origin: accept connections forever, a thread each
+	char portStr[16];
+	sprintf(portStr, "%d", port);
+	int listenFd = Open_listenfd(portStr);
+	memset(filler, 'x', sizeof(filler));
+	while(1){
+		int *connFd = Malloc(sizeof(int));
+		*connFd = accept(listenFd, NULL, NULL);
+		if(*connFd < 0){
+			free(connFd);
+			continue;
+		}
+		pthread_t tid;
+		Pthread_create(&tid, NULL, originConn, connFd);
+	}
+}
+
+pid_t startProxy(int port){
+	//run the proxy with its extra arguments and port
+	char cmd[MAXLINE];
+	snprintf(cmd, sizeof(cmd), "exec %s %s %d", config.proxyPath, config.proxyArgs, port);
+	pid_t pid = Fork();
+	if(pid == 0){
+		execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+int waitForPort(int port){
+	//wait for a server to accept connections on port, for up to 5 seconds
+	//return 0 once it does, -1 otherwise
+	char portStr[16];
+	int i;
+	sprintf(portStr, "%d", port);
+	for(i = 0; i < 500; i++){
+		int fd = open_clientfd("127.0.0.1", portStr);
+		if(fd >= 0){
+			close(fd);
+			return 0;
+		}
+		usleep(10000);
+	}
+	return -1;
+}
+
+int connectTarget(){
+	//a new client connection: to the proxy, or to the origin in direct mode
+	char portStr[16];
+	sprintf(portStr, "%d", config.direct ? config.port : config.port + 1);
+	return open_clientfd("127.0.0.1", portStr);
+}
+
+long fetchOne(int *fd, rio_t *rio, int url){
+	//request url on *fd, which is reconnected if needed, and read the
+	//whole response
+	//return the number of body bytes, -1 on error
+	char req[MAXLINE], buf[MAXLINE];
+	if(*fd < 0){
+		if((*fd = connectTarget()) < 0){
+			return -1;
+		}
+		noDelay(*fd);
+		rio_readinitb(rio, *fd);
+	}
+	if(config.direct){
+		sprintf(req, "GET /o/%d/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", url, urlSize[url], config.port);
+	}
+	else{
+		sprintf(req, "GET http://127.0.0.1:%d/o/%d/%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n",
+			config.port, url, urlSize[url], config.port);
+	}
+	if(rio_writen(*fd, req, strlen(req)) < 0 || rio_readlineb(rio, buf, MAXLINE) <= 0){
+		return -1;
+	}
+	long length = -1;
+	int keepAlive = 1;
+	while(1){
+		if(rio_readlineb(rio, buf, MAXLINE) <= 0){
+			return -1;
+		}
+		if(strcmp(buf, "\r\n") == 0){
+			break;
+		}
+		if(strncasecmp(buf, "Content-Length:", 15) == 0){
+			length = atol(buf + 15);
+		}
+		else if(strncasecmp(buf, "Connection:", 11) == 0 && strcasestr(buf, "close") != NULL){
+			keepAlive = 0;
+		}
+	}
+
+	//without a length, the body ends when the proxy closes
+	long got = 0;
+	while(length < 0 || got < length){
+		long want = sizeof(buf);
+		if(length >= 0 && length - got < want){
+			want = length - got;
+		}
+		ssize_t n = rio_readnb(rio, buf, want);
+		if(n < 0){
+			return -1;
+		}
+		if(n == 0){
+			if(length >= 0){
+				return -1;
+			}
+			keepAlive = 0;
+			break;
+		}
+		if(config.relay){
+			//every byte of a body is filler
+			ssize_t i;
+			for(i = 0; i < n; i++){
+				if(buf[i] != 'x'){
+					return -1;
+				}
+			}
+		}
+		got += n;
+	}
+	if(!keepAlive){
+		close(*fd);
+		*fd = -1;
+	}
+	return got;
+}
+
+void* clientThread(void *vargp){
+	//issue requests on a kept-alive connection until all are handed out
+	//only those after the warmup are counted
+	benchThread *t = (benchThread*)vargp;
+	int fd = -1;
+	rio_t rio;
+	while(1){
+		long n = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+		if(n >= config.warmup + config.requests){
+			break;
+		}
+		int url = pickUrl(&t->seed);
+		unsigned long start = nowUsec();
+		long got = fetchOne(&fd, &rio, url);
+		unsigned long usec = nowUsec() - start;
+		if(got < 0){
+			if(fd >= 0){
+				close(fd);
+				fd = -1;
+			}
+		}
+		if(n < config.warmup){
+			continue;
+		}
+		if(got < 0){
+			t->errors++;
+			continue;
+		}
+		t->done++;
+		t->bytes += got;
+		t->hist[histBucket(usec)]++;
+	}
+	if(fd >= 0){
+		close(fd);
+	}
+	return NULL;
+}
+
+void printProxyStats(){
+	//print the counters of the proxy, from its stats endpoint
+	char portStr[16], buf[MAXLINE];
+	sprintf(portStr, "%d", config.port + 1);
+	int fd = open_clientfd("127.0.0.1", portStr);
+	if(fd < 0){
+		return;
+	}
+	sprintf(buf, "GET /stats HTTP/1.0\r\n\r\n");
+	if(rio_writen(fd, buf, strlen(buf)) >= 0){
+		rio_t rio;
+		int inBody = 0;
+		rio_readinitb(&rio, fd);
+		printf("proxy:\n");
+		while(rio_readlineb(&rio, buf, MAXLINE) > 0){
+			if(inBody){
+				printf("  %s", buf);
+			}
+			else if(strcmp(buf, "\r\n") == 0){
+				inBody = 1;
+			}
+		}
+	}
+	close(fd);
+}
+
+void usage(char *prog){
+	fprintf(stderr, "usage: %s [-c conns] [-n requests] [-w warmup] [-u urls] [-z zipf]\n"
+		"\t[-m size:weight,...] [-P port] [-b proxy] [-x \"proxy args\"] [-D | -R]\n"
+		"  -D benchmarks the origin directly, without the proxy\n"
+		"  -R compares the default relay of the proxy with its io_uring relay (-u)\n", prog);
+	exit(1);
+}
+
+void runBench(char *label, char *mix){
+	//drive the proxy, or the origin in direct mode, with the configured
+	//load, and report
+	benchThread *threads = Calloc(config.conns, sizeof(benchThread));
+	int i;
+	issued = 0;
+	unsigned long start = nowUsec();
+	long originBefore = __atomic_load_n(originRequests, __ATOMIC_RELAXED);
+	for(i = 0; i < config.conns; i++){
+		threads[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+		Pthread_create(&threads[i].tid, NULL, clientThread, &threads[i]);
+	}
+	if(config.warmup > 0){
+		//measure from the end of the warmup
+		while(__atomic_load_n(&issued, __ATOMIC_RELAXED) < config.warmup){
+			usleep(1000);
+		}
+		start = nowUsec();
+		originBefore = __atomic_load_n(originRequests, __ATOMIC_RELAXED);
+	}
+	for(i = 0; i < config.conns; i++){
+		Pthread_join(threads[i].tid, NULL);
+	}
+	double secs = (nowUsec() - start) / 1e6;
+
+	//merge the threads and report
+	static unsigned long hist[HIST_BUCKETS];
+	long done = 0, errors = 0;
+	unsigned long bytes = 0, max = 0;
+	memset(hist, 0, sizeof(hist));
+	for(i = 0; i < config.conns; i++){
+		int j;
+		done += threads[i].done;
+		errors += threads[i].errors;
+		bytes += threads[i].bytes;
+		for(j = 0; j < HIST_BUCKETS; j++){
+			hist[j] += threads[i].hist[j];
+			if(threads[i].hist[j] != 0 && histValue(j) > max){
+				max = histValue(j);
+			}
+		}
+	}
+	free(threads);
+	long fetched = *originRequests - originBefore;
+	printf("%s: %d connections, %d URLs, zipf %.2f, mix %s\n",
+		label, config.conns, config.urls, config.zipf, mix);
+	printf("requests: %ld in %.2f s, %.0f req/s, %.1f MB/s, %ld errors\n",
+		done, secs, done / secs, bytes / secs / 1e6, errors);
+	if(done > 0){
+		printf("latency: p50 %lu us, p99 %lu us, p999 %lu us, max %lu us\n",
+			histPercentile(hist, done, 50), histPercentile(hist, done, 99),
+			histPercentile(hist, done, 99.9), max);
+		if(!config.direct){
+			printf("hit ratio: %.2f%% (%ld of %ld requests reached the origin)\n",
+				100.0 * (done + errors - fetched) / (done + errors), fetched, done + errors);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+    //parse the options
+    int opt;
+    char *mix = DEFAULT_MIX;
+    config.proxyPath = "./proxy";
+    config.proxyArgs = "";
+    config.conns = DEFAULT_CONNS;
+    config.requests = DEFAULT_REQUESTS;
+    config.warmup = 0;
+    config.urls = DEFAULT_URLS;
+    config.zipf = DEFAULT_ZIPF;
+    config.port = DEFAULT_PORT;
+    config.direct = 0;
+    config.relay = 0;
+    while((opt = getopt(argc, argv, "c:n:w:u:z:m:P:b:x:DR")) != -1){
+	switch(opt){
+	case 'c':
+	    config.conns = atoi(optarg);
+	    break;
+	case 'n':
+	    config.requests = atol(optarg);
+	    break;
+	case 'w':
+	    config.warmup = atol(optarg);
+	    break;
+	case 'u':
+	    config.urls = atoi(optarg);
+	    break;
+	case 'z':
+	    config.zipf = atof(optarg);
+	    break;
+	case 'm':
+	    mix = optarg;
+	    break;
+	case 'P':
+	    config.port = atoi(optarg);
+	    break;
+	case 'b':
+	    config.proxyPath = optarg;
+	    break;
+	case 'x':
+	    config.proxyArgs = optarg;
+	    break;
+	case 'D':
+	    config.direct = 1;
+	    break;
+	case 'R':
+	    config.relay = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if(config.conns < 1 || config.requests < 1 || config.warmup < 0 || config.urls < 1 || config.zipf < 0 || parseMix(mix) < 0
+	|| (config.direct && config.relay)){
+	usage(argv[0]);
+    }
+    setupUrls();
+    Signal(SIGPIPE, SIG_IGN);
+
+    //the origin, counting its requests in memory shared with us
+    originRequests = mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(originRequests == MAP_FAILED){
+	unix_error("mmap error");
+    }
+    *originRequests = 0;
+    pid_t originPid = Fork();
+    if(originPid == 0){
+	runOrigin(config.port);
+	_exit(0);
+    }
+    if(waitForPort(config.port) < 0){
+	fprintf(stderr, "the origin did not start\n");
+	kill(originPid, SIGTERM);
+	return 1;
+    }
+    if(config.direct){
+	runBench("origin", mix);
+    }
+
+    //the proxy, or with -R, the proxy relaying as it does by default and
+    //then through io_uring, each run against a proxy of its own
+    char uringArgs[MAXLINE];
+    snprintf(uringArgs, sizeof(uringArgs), "%s -u", config.proxyArgs);
+    char *runArgs[2] = {config.proxyArgs, uringArgs};
+    char *runLabels[2] = {"proxy, default relay", "proxy -u, io_uring relay"};
+    int run;
+    for(run = 0; !config.direct && run < (config.relay ? 2 : 1); run++){
+	config.proxyArgs = runArgs[run];
+	pid_t proxyPid = startProxy(config.port + 1);
+	if(waitForPort(config.port + 1) < 0){
+	    fprintf(stderr, "the proxy did not start\n");
+	    kill(proxyPid, SIGTERM);
+	    kill(originPid, SIGTERM);
+	    return 1;
+	}
+	runBench(config.relay ? runLabels[run] : "proxy", mix);
+	printProxyStats();
+	kill(proxyPid, SIGTERM);
+	waitpid(proxyPid, NULL, 0);
+    }
+    kill(originPid, SIGTERM);
+    waitpid(originPid, NULL, 0);
+    return 0;
+}
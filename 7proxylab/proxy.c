@@ -1,390 +1,5695 @@
+#define _GNU_SOURCE
 #include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+//max size of the head of a response that we keep, leaving room for the
+//framing headers of this proxy in a MAXBUF buffer
+#define MAX_HEAD_SIZE (MAXBUF - 256)
+
+//number of independently locked cache shards, must be a power of 2
+//each shard may use MAX_CACHE_SIZE / CACHE_SHARDS bytes
+#define CACHE_SHARDS 8
+
+//number of buckets in the hash table of each shard, must be a power of 2
+#define CACHE_BUCKETS 512
+
+//default number of worker threads, and capacity of the connection queue
+#define DEFAULT_THREADS 32
+#define DEFAULT_QUEUE 256
+
+#if MAX_CACHE_SIZE / CACHE_SHARDS < MAX_OBJECT_SIZE
+#error "a cache shard must be able to hold an object of MAX_OBJECT_SIZE"
+#endif
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
 struct cc{
 	//a struct for cache.
 	//it records the source of the cache: host, path and port number
-	//and also its size, timestamp
-	//content field is its real body.
-	//prev and next pointer fields are used in maintaining the list.
+	//and also its size, and its reference bit for the CLOCK and SIEVE policies
+	//content field is its real response: the head kept from the server,
+	//i.e. headLen bytes of status line and end-to-end headers, then the body.
+	//an object is a single allocation sized to what it holds: the body
+	//in content, followed by the host and path strings that host and path
+	//point to. charge is the size of the whole allocation, which is what
+	//the object costs against the budget of its shard.
+	//prev and next pointer fields are used in maintaining the list,
+	//which the eviction policy keeps in its order.
+	//hash is the precomputed hash of (host, path, port), and hNext
+	//chains the objects falling into the same bucket of its shard.
+	//refCnt counts the references: one held by the shard while the object
+	//is linked, plus one for each reader streaming it. an object is never
+	//modified once it is linked, and it is freed when refCnt drops to 0.
+	//the only exception is its freshness, set with atomic stores: it is
+	//fresh until expires (in seconds of the wall clock), and may still be
+	//served for swr seconds after that while it is revalidated in the
+	//background, which revalidating is set for.
 
-	char host[MAXBUF];
-	char path[MAXBUF];
+	char *host;
+	char *path;
 	int port;
 	int size;
-	unsigned long timeStamp;
-	char content[MAX_OBJECT_SIZE];
+	int headLen;
+	int charge;
+	unsigned long hash;
+	struct cc *hNext;
+	int referenced;
+	int refCnt;
+	long expires;
+	int swr;
+	int revalidating;
 	struct cc *prev, *next;
+	char content[];
 
 };
 
 typedef struct cc cache;
 
-//the head of cache list
-cache *cacheHead = NULL;
+struct cs{
+	//a shard of the cache.
+	//an object lives in the shard picked by its hash, and each shard
+	//has its own lock, list, clock hand, hash table and byte budget,
+	//so threads working on different shards never contend.
+	//shards are aligned to cache lines so their locks do not share one.
 
-//usage of cache
-int cacheSize = 0;
+	pthread_rwlock_t lock;
+	//the head and tail of cache list
+	struct cc *head, *tail;
+	//the hand of CLOCK and SIEVE: the next object to check for eviction
+	//NULL means start over from tail
+	struct cc *hand;
+	//hash table indexing the cache list by (host, path, port)
+	struct cc *table[CACHE_BUCKETS];
+	//usage of this shard
+	int size;
+	//taken by readers moving objects in the list, for LRU only
+	pthread_mutex_t lruLock;
 
-//the recorded timestamp.
-//note that this mechanism requires no more than 2^64 read and write operations in a run
-//which is quite realistic!
-unsigned long tStmp = 0;
+} __attribute__((aligned(64)));
 
-//mutex
-static sem_t mtx;
+typedef struct cs cacheShard;
 
-//cache read and write lock
-pthread_rwlock_t cacheRWLock;
+//the shards of cache, in the shared region in worker mode
+cacheShard localShards[CACHE_SHARDS];
+cacheShard *cacheShards = localShards;
 
-cache* readCache(char *host, char *path, int port, int connFd){
-	//read the cache
-	//if there is a hit, write it to connFd
-	//if hit: return the pointer to the cache object
-	//otherwise, return NULL
+struct cq{
+	//a bounded queue of accepted connections, shared by the main thread
+	//and the worker threads, in the style of the sbuf package.
+	//fds is a ring of n connected descriptors, and queuedAt records when
+	//each of them was queued. slots counts free slots and items counts
+	//queued connections, so the main thread blocks when it is full.
+	//the counters are only updated under mutex, and report how deep the
+	//queue gets and how long connections wait in it (in microseconds).
 
-	//first use a read lock
-	pthread_rwlock_rdlock(&cacheRWLock);
+	int *fds;
+	unsigned long *queuedAt;
+	int n;
+	int front, rear;
+	sem_t mutex, slots, items;
+	int depth, maxDepth;
+	unsigned long dequeued;
+	unsigned long totalWait, maxWait;
 
-	cache *thisCache = cacheHead;
-	while(thisCache != NULL){
-		if(strcmp(thisCache->host, host)==0 && strcmp(thisCache->path, path)==0 && thisCache->port == port){
-			//if we have an identical record
-			break;
+};
+
+typedef struct cq connQueue;
+
+//the queue of accepted connections
+connQueue connQ;
+
+
+unsigned long nowUsec(){
+	//the current time in microseconds, from the monotonic clock
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//the stages of a request whose latency is measured, in microseconds
+//each is timed from the arrival of the request line, except lookup and
+//connect, which are timed on their own
+#define ST_PARSE 0	//reading and parsing the request
+#define ST_LOOKUP 1	//looking the object up in the cache
+#define ST_CONNECT 2	//getting a connection to the server
+#define ST_FIRST_BYTE 3	//until the first byte of the response is sent
+#define ST_TRANSFER 4	//until the whole response is sent
+#define N_STAGES 5
+
+//latency histograms are log-linear, in the style of HDR histograms:
+//each power of 2 is split into HIST_SUB buckets, so a value is off by
+//at most 1/HIST_SUB, up to 2^HIST_MAX_BITS
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct ms{
+	//the counters of a thread.
+	//upstreamCalls counts the system calls that sending the
+	//upstreamRequests to servers took.
+	//staleServed counts the stale objects served while they were
+	//revalidated in the background, revalidations the conditional
+	//requests sent for stale objects, and notModified those answered 304.
+	//timeouts counts the connections dropped by the deadline checks of
+	//the proxy itself, rather than by a socket timeout, and idleEvicted
+	//the idle clients dropped to free a thread for a queued connection.
+	//partial counts the range requests answered from the cache with a
+	//206, and unsatisfiable those answered 416.
+	//hits and misses count the lookups of the cache, evictions the
+	//objects its policy evicted, and rejected those admission refused.
+	//only their thread writes them, with plain stores, so counting costs
+	//no locked instruction and no shared cache line; printStats() merges
+	//the counters of all threads, which are chained by next, when it
+	//reads them.
+
+	unsigned long requests;
+	unsigned long cacheBytes;
+	unsigned long originBytes;
+	unsigned long upstreamRequests;
+	unsigned long upstreamCalls;
+	unsigned long staleServed;
+	unsigned long revalidations;
+	unsigned long notModified;
+	unsigned long timeouts;
+	unsigned long idleEvicted;
+	unsigned long partial;
+	unsigned long unsatisfiable;
+	unsigned long hits, misses, evictions, rejected;
+	unsigned long hist[N_STAGES][HIST_BUCKETS];
+	struct ms *next;
+
+};
+
+typedef struct ms metrics;
+
+//the counters of every thread that has counted anything
+metrics *allMetrics = NULL;
+pthread_mutex_t metricsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//the counters of this thread, created when first needed
+static __thread metrics *threadMetrics = NULL;
+
+//when the request being served by this thread arrived, and whether its
+//first byte has been sent
+static __thread unsigned long reqStart = 0;
+static __thread int reqFirstSent = 0;
+
+//connections open from clients
+long activeConns = 0;
+
+//default deadlines, in seconds: how long a socket may make no progress
+//at all when the proxy reads from it, and writes to it, before the
+//connection is dropped. they keep stalled clients and servers from
+//holding threads and descriptors forever
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+
+int readTimeout = DEFAULT_READ_TIMEOUT, writeTimeout = DEFAULT_WRITE_TIMEOUT;
+
+metrics* getMetrics(){
+	//return the counters of this thread
+	//if they cannot be allocated, the counts go to a dummy no one reads
+	static metrics lost;
+	if(threadMetrics == NULL){
+		metrics *m = calloc(1, sizeof(metrics));
+		if(m == NULL){
+			return &lost;
 		}
-		thisCache = thisCache->next;
+		pthread_mutex_lock(&metricsMutex);
+		m->next = allMetrics;
+		allMetrics = m;
+		pthread_mutex_unlock(&metricsMutex);
+		threadMetrics = m;
+	}
+	return threadMetrics;
+}
+
+void countAdd(unsigned long *counter, unsigned long n){
+	//add n to a counter of this thread
+	//a relaxed store, not an atomic add: the thread is the only writer
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+int histBucket(unsigned long v){
+	//the bucket of v in a histogram
+	if(v >= (1UL << HIST_MAX_BITS)){
+		v = (1UL << HIST_MAX_BITS) - 1;
 	}
+	if(v < HIST_SUB){
+		return v;
+	}
+	int shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+	return shift * HIST_SUB + (v >> shift);
+}
 
-	if(thisCache != NULL){
-		//if we find the object cached
-		//write it to connFd
-		Rio_writen(connFd, thisCache->content, thisCache->size);
+unsigned long histValue(int bucket){
+	//the largest value falling into bucket
+	if(bucket < HIST_SUB){
+		return bucket;
 	}
+	int shift = bucket / HIST_SUB - 1;
+	return ((unsigned long)(bucket - shift * HIST_SUB + 1) << shift) - 1;
+}
 
-	//unlock
-	pthread_rwlock_unlock(&cacheRWLock);
+void recordLatency(int stage, unsigned long usec){
+	metrics *m = getMetrics();
+	countAdd(&m->hist[stage][histBucket(usec)], 1);
+}
 
-	return thisCache;
+void countBytes(int fromCache, unsigned long n){
+	//count n bytes of body sent to clients, from the cache or the server
+	metrics *m = getMetrics();
+	countAdd(fromCache ? &m->cacheBytes : &m->originBytes, n);
 }
 
+void markFirstByte(){
+	//the first byte of the response to the request of this thread is
+	//about to be sent
+	if(!reqFirstSent && reqStart != 0){
+		recordLatency(ST_FIRST_BYTE, nowUsec() - reqStart);
+		reqFirstSent = 1;
+	}
+}
 
-void updateCache(cache *thisCache){
-	//when a cache is read, update the timestamp for it
-	//must use a write lock
+unsigned long hashKey(char *host, char *path, int port){
+	//hash the key (host, path, port) of a cache object
+	//using 64-bit FNV-1a over host, a separator, path and the port
 
-	//ill-formed call
-	if(thisCache == NULL){
-		return;
+	unsigned long h = 14695981039346656037UL;
+	char *p;
+	for(p = host; *p != '\0'; p++){
+		h = (h ^ (unsigned char)*p) * 1099511628211UL;
 	}
+	h = (h ^ ' ') * 1099511628211UL;
+	for(p = path; *p != '\0'; p++){
+		h = (h ^ (unsigned char)*p) * 1099511628211UL;
+	}
+	h = (h ^ (unsigned long)port) * 1099511628211UL;
+	return h;
+}
 
-	//write lock
-	pthread_rwlock_wrlock(&cacheRWLock);
+cacheShard* getShard(unsigned long hash){
+	//pick the shard of an object by its hash
+	//the low bits index the buckets within the shard, and the last bytes
+	//of a key barely reach the high bits of FNV-1a, so keys that differ
+	//only at the end share them. mix the whole hash into the top bits
+	//with a Fibonacci multiply and take those
+	return &cacheShards[((hash * 0x9e3779b97f4a7c15UL) >> 56) & (CACHE_SHARDS - 1)];
+}
 
-	//update its timestamp
-	thisCache->timeStamp = tStmp;
-	tStmp++;
+cache* findCache(cacheShard *shard, char *host, char *path, int port, unsigned long hash){
+	//look up the object with key (host, path, port) in the table of shard
+	//we assume that when entering this function, there is already a lock on shard
+	//return the object, or NULL if it is not cached
 
-	//unlock
-	pthread_rwlock_unlock(&cacheRWLock);
+	cache *thisCache = shard->table[hash & (CACHE_BUCKETS - 1)];
+	while(thisCache != NULL){
+		//compare the hash first, strings only when it matches
+		if(thisCache->hash == hash && thisCache->port == port && strcmp(thisCache->host, host)==0 && strcmp(thisCache->path, path)==0){
+			//if we have an identical record
+			break;
+		}
+		thisCache = thisCache->hNext;
+	}
+	return thisCache;
 }
 
-void deleteLRU(){
-	//use LRU policy to delete a cache object from cache list, according
-	//to their timestamps
-	//and update the total cache size
-	//if no cache in list, do nothing
-	//we assume that when entering this function, there is already a write lock
-	//it should only be used in addToCache()
+//in worker mode, the objects of each shard are allocated from an arena
+//of ARENA_SIZE bytes in the shared region. it is twice the budget of the
+//shard, for the objects that are evicted while pinned, and for holes
+#define ARENA_SIZE ((2 * (MAX_CACHE_SIZE / CACHE_SHARDS) + 4095) & ~4095)
+
+struct ab{
+	//a block of an arena, of size bytes including this header.
+	//free blocks are chained by next in address order, so that a block
+	//freed next to free ones merges with them
+
+	long size;
+	struct ab *next;
+
+};
+
+typedef struct ab arenaBlock;
 
-	//if the list is empty, just ignore
-	if(cacheHead == NULL){
+struct ar{
+	//an arena of the shared region: a first-fit allocator over its free
+	//list, with a process-shared lock of its own, as an object can be
+	//freed by any reader, holding no lock of its shard
+
+	pthread_mutex_t lock;
+	arenaBlock *free;
+
+};
+
+typedef struct ar arena;
+
+//the arenas of the shards, NULL unless the cache is shared
+arena *arenas = NULL;
+
+//whether this process is a worker, with a listening socket of its own
+int reusePort = 0;
+
+//max number of worker processes
+#define MAX_WORKERS 64
+
+//the lanes of a worker, which its threads are spread over
+#define WORKER_LANES 64
+
+//the slots of the pin table of a worker, must be a power of 2, and how
+//many of them are probed for an object
+#define WORKER_PINS 16384
+#define PIN_PROBES 256
+
+struct wl{
+	//a lane of a worker: sections counts its threads that are in a
+	//section taking locks of the shared region, and since is when the
+	//first of them entered it (in seconds of the monotonic clock)
+
+	int sections;
+	long since;
+
+} __attribute__((aligned(64)));
+
+typedef struct wl workerLane;
+
+struct ws{
+	//what the supervisor knows of a worker, in the shared region.
+	//a worker that died with no thread in a section left the region
+	//consistent: only its references to objects are left, which pins
+	//records, so they can be dropped for it. a slot of pins holds an
+	//object it pinned, with the low bit set if it is also the one
+	//revalidating it. beat is the last time its statsThread ran, to
+	//tell a hung worker (in seconds of the monotonic clock)
+
+	workerLane lanes[WORKER_LANES];
+	long beat;
+	unsigned long pins[WORKER_PINS];
+
+};
+
+typedef struct ws workerShare;
+
+//the share of this worker, NULL in the supervisor and without workers
+workerShare *thisWorker = NULL;
+
+//set in the shared region when a worker died holding one of its mutexes,
+//NULL unless the cache is shared
+int *sharedBroken = NULL;
+
+//set when a worker is told to stop: its threads take no new lock of the
+//shared region from then on, so it can exit holding none of them
+int stopping = 0;
+
+//how deep this thread is in sections taking locks of the shared region,
+//and the lane it counts in
+static __thread int sharedDepth = 0;
+static __thread workerLane *sharedLane = NULL;
+int nextLane = 0;
+
+long nowSec(){
+	//the current time in seconds, from the monotonic clock
+	return (long)(nowUsec() / 1000000);
+}
+
+void sharedEnter(){
+	//enter a section that takes locks of the shared region
+	//once the worker is stopping, a thread entering one parks here
+	//for good instead, holding none of them, until the worker exits
+	if(thisWorker == NULL || sharedDepth++ > 0){
 		return;
 	}
-
-	//find the victim, i.e. the object with the earliest timestamp
-	cache *toDel = cacheHead;
-	cache *iter = cacheHead;
-	long tstmp = cacheHead->timeStamp;
-	while(iter != NULL){
-		if(iter->timeStamp < tstmp){
-			tstmp = iter->timeStamp;
-			toDel = iter;
+	if(sharedLane == NULL){
+		sharedLane = &thisWorker->lanes[__atomic_fetch_add(&nextLane, 1, __ATOMIC_RELAXED) % WORKER_LANES];
+	}
+	if(__atomic_add_fetch(&sharedLane->sections, 1, __ATOMIC_SEQ_CST) == 1){
+		__atomic_store_n(&sharedLane->since, nowSec(), __ATOMIC_RELAXED);
+	}
+	if(__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)){
+		__atomic_sub_fetch(&sharedLane->sections, 1, __ATOMIC_SEQ_CST);
+		while(1){
+			pause();
 		}
-		iter = iter->next;
 	}
+}
 
-	//the victim is *toDel at this moment
-	//first update cache size
-	cacheSize -= toDel->size;
+void sharedLeave(){
+	//leave a section entered by sharedEnter()
+	if(thisWorker == NULL || --sharedDepth > 0){
+		return;
+	}
+	__atomic_sub_fetch(&sharedLane->sections, 1, __ATOMIC_RELEASE);
+}
 
-	//delete toDel and free it
-	if(toDel == cacheHead){
-		cacheHead = toDel->next;
+int inSection(workerShare *ws){
+	//whether a thread of the worker of ws is in a section
+	int i;
+	for(i = 0; i < WORKER_LANES; i++){
+		if(__atomic_load_n(&ws->lanes[i].sections, __ATOMIC_SEQ_CST) > 0){
+			return 1;
+		}
 	}
-	if(toDel->next != NULL){
-		toDel->next->prev = toDel->prev;
+	return 0;
+}
+
+int cacheBroken(){
+	//whether the shared region is broken: it is not used any more
+	return sharedBroken != NULL && __atomic_load_n(sharedBroken, __ATOMIC_RELAXED);
+}
+
+int sharedLock(pthread_mutex_t *m){
+	//lock a mutex of the shared region, which is robust
+	//if a worker died holding it, what it guards may be half updated:
+	//the region is marked broken, for the supervisor to drop it, and
+	//nothing in it is touched any more
+	//return 0 on success, -1 if the region is broken, without the lock
+	if(pthread_mutex_lock(m) == EOWNERDEAD){
+		__atomic_store_n(sharedBroken, 1, __ATOMIC_RELAXED);
+		pthread_mutex_consistent(m);
 	}
-	if(toDel->prev != NULL){
-		toDel->prev->next = toDel->next;
+	if(cacheBroken()){
+		pthread_mutex_unlock(m);
+		return -1;
 	}
-	free(toDel);
+	return 0;
 }
 
-void addToCache(char *host, char *path, int port, char *response, int readLen){
-	//add a new object to cache
+int pinRecord(cache *thisCache, int revalidating){
+	//record a reference of this worker to thisCache in its pin table,
+	//in a section
+	//return 0 on success, -1 if the slots it may take are all taken
+	int i;
+	if(thisWorker == NULL){
+		return 0;
+	}
+	unsigned long pin = (unsigned long)thisCache | revalidating;
+	for(i = 0; i < PIN_PROBES; i++){
+		unsigned long *slot = &thisWorker->pins[(thisCache->hash + i) & (WORKER_PINS - 1)];
+		unsigned long empty = 0;
+		if(__atomic_compare_exchange_n(slot, &empty, pin, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			return 0;
+		}
+	}
+	return -1;
+}
 
-	//if bad form or too long, just ignore
-	//in fact this cannot happen, we explicitly check it before calling this func
-	if(response == NULL || readLen > MAX_OBJECT_SIZE){
+void pinForget(cache *thisCache, int revalidating){
+	//forget a reference recorded by pinRecord(), in a section
+	//any slot of the same object will do
+	int i;
+	if(thisWorker == NULL){
 		return;
 	}
+	unsigned long pin = (unsigned long)thisCache | revalidating;
+	for(i = 0; i < PIN_PROBES; i++){
+		unsigned long *slot = &thisWorker->pins[(thisCache->hash + i) & (WORKER_PINS - 1)];
+		unsigned long found = pin;
+		if(__atomic_compare_exchange_n(slot, &found, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			return;
+		}
+	}
+}
 
-	//prepare the cache object
-	//except the timestamp field, which requires a lock
-	cache *newCache = (cache*)malloc(sizeof(cache));
-	strcpy(newCache->host, host);
-	strcpy(newCache->path, path);
-	newCache->port = port;
-	newCache->size = readLen;
-	int i;
-	for(i = 0; i < readLen; i++){
-		newCache->content[i] = response[i];
+void stopWorker(){
+	//exit a worker once none of its threads is in a section: a lock left
+	//held would block the other workers and the supervisor for good, and
+	//the supervisor drops the references it leaves
+	__atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+	while(inSection(thisWorker)){
+		usleep(1000);
+	}
+	_exit(0);
+}
+
+void* arenaAlloc(arena *a, long n){
+	//allocate n bytes from a, NULL if no free block is large enough
+	//the end of a block is cut off for it, so the free list only changes
+	//when a whole block is taken
+	arenaBlock **link, *b;
+	n = (n + sizeof(arenaBlock) + 15) & ~15L;
+	if(sharedLock(&a->lock) < 0){
+		return NULL;
+	}
+	for(link = &a->free; *link != NULL; link = &((*link)->next)){
+		b = *link;
+		if(b->size < n){
+			continue;
+		}
+		if(b->size - n >= 64){
+			b->size -= n;
+			b = (arenaBlock*)((char*)b + b->size);
+			b->size = n;
+		}
+		else{
+			*link = b->next;
+		}
+		pthread_mutex_unlock(&a->lock);
+		return b + 1;
 	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
 
-	//begin our transaction, first write lock
-	pthread_rwlock_wrlock(&cacheRWLock);
+void arenaFree(arena *a, void *ptr){
+	//give a block allocated from a back, merging it with its neighbours
+	arenaBlock *b = (arenaBlock*)ptr - 1, *prev = NULL, *next;
+	if(sharedLock(&a->lock) < 0){
+		return;
+	}
+	for(next = a->free; next != NULL && next < b; next = next->next){
+		prev = next;
+	}
+	b->next = next;
+	if(next != NULL && (char*)b + b->size == (char*)next){
+		b->size += next->size;
+		b->next = next->next;
+	}
+	if(prev == NULL){
+		a->free = b;
+	}
+	else if((char*)prev + prev->size == (char*)b){
+		prev->size += b->size;
+		prev->next = b->next;
+	}
+	else{
+		prev->next = b;
+	}
+	pthread_mutex_unlock(&a->lock);
+}
 
-	//evict older blocks to fit the size
-	while(cacheSize > MAX_CACHE_SIZE - readLen){
-		deleteLRU(); 
+cache* cacheAlloc(cacheShard *shard, int charge){
+	//allocate an object of charge bytes for shard: from the heap, or
+	//from the arena of shard if the cache is shared
+	if(arenas == NULL){
+		return malloc(charge);
 	}
+	sharedEnter();
+	cache *thisCache = arenaAlloc(&arenas[shard - cacheShards], charge);
+	sharedLeave();
+	return thisCache;
+}
 
-	//set timestamp
-	newCache->timeStamp = tStmp;
-	tStmp++;
-	
-	//add to the head of cache list
-	newCache->next = cacheHead;
-	newCache->prev = NULL;
-	if(cacheHead != NULL){
-		cacheHead->prev = newCache;
+void cacheFree(cache *thisCache){
+	//free an object allocated by cacheAlloc()
+	if(arenas == NULL){
+		free(thisCache);
+		return;
 	}
-	cacheHead = newCache;
-	cacheSize += readLen;
+	sharedEnter();
+	arenaFree(&arenas[getShard(thisCache->hash) - cacheShards], thisCache);
+	sharedLeave();
+}
 
-	//unlock
-	pthread_rwlock_unlock(&cacheRWLock);
+void unpinCache(cache *thisCache, int revalidating){
+	//drop a reference to a cache object, and free it with the last one
+	//if revalidating is set, it is the reference of its revalidation,
+	//which is over
+	//needs no lock: once unlinked, only pinned readers can reach the object
+	sharedEnter();
+	pinForget(thisCache, revalidating);
+	if(revalidating){
+		__atomic_store_n(&thisCache->revalidating, 0, __ATOMIC_RELEASE);
+	}
+	if(__atomic_sub_fetch(&thisCache->refCnt, 1, __ATOMIC_ACQ_REL) == 0){
+		cacheFree(thisCache);
+	}
+	sharedLeave();
 }
 
-int parseURL(char *URL, char *hostName, char *path){
-    //parse the URL: if it is illegal, return -1
-    //otherwise return the port number; and parsed host name and path are
-    //stored in hostName and path.
-    //must ensure that hostName and path are initialized with '\0''s
+void releaseCache(cache *thisCache){
+	//drop a reference to a cache object
+	unpinCache(thisCache, 0);
+}
 
-    int port = 80;//the default port
+struct ep{
+	//an eviction policy of the cache, which orders the list of a shard.
+	//hit marks an object read, with a read lock on its shard.
+	//insert links a new object into the list, and victim picks the
+	//object to evict, with the write lock on its shard. the victim stays
+	//linked, removeCache() takes it off.
 
-    if(strlen(URL) <= 7){
-	//ill-formed URL
-	return -1;
-    }
+	char *name;
+	void (*hit)(cacheShard *shard, cache *thisCache);
+	void (*insert)(cacheShard *shard, cache *thisCache);
+	cache* (*victim)(cacheShard *shard);
 
-    //beginning of real URL
-    char *realHost = URL + 7;
+};
 
-    //temporarily set the 7th position to '\0' to call strcmp
-    char pos7 = *realHost;
-    *realHost = '\0';
+typedef struct ep evictPolicy;
 
-    //check length > 7 and first 7 characters
-    if(strcmp(URL, "http://") != 0){
-	return -1;
-    }
+void linkAfter(cacheShard *shard, cache *prev, cache *thisCache){
+	//link thisCache into the list of shard after prev, or at the head
+	//if prev is NULL
+	thisCache->prev = prev;
+	thisCache->next = (prev != NULL) ? prev->next : shard->head;
+	if(prev != NULL){
+		prev->next = thisCache;
+	}
+	else{
+		shard->head = thisCache;
+	}
+	if(thisCache->next != NULL){
+		thisCache->next->prev = thisCache;
+	}
+	else{
+		shard->tail = thisCache;
+	}
+}
 
-    //realHost now points to the start of hostname
-    *realHost = pos7;
-    int offset = 0;
-    int realLen = strlen(realHost);
-    while(offset < realLen){
-        if(realHost[offset] == ':' || realHost[offset] == '/'){
-		//offset is the point at which hostname ends
-		break;
+void unlinkList(cacheShard *shard, cache *thisCache){
+	//take thisCache off the list of shard
+	if(thisCache == shard->head){
+		shard->head = thisCache->next;
 	}
-        offset ++;
-    }
+	if(thisCache == shard->tail){
+		shard->tail = thisCache->prev;
+	}
+	if(thisCache->next != NULL){
+		thisCache->next->prev = thisCache->prev;
+	}
+	if(thisCache->prev != NULL){
+		thisCache->prev->next = thisCache->next;
+	}
+}
 
-    if(offset == 0){
-	return -1;//no host name, illegal
-    }
-    int i;
-    if(offset == realLen){
-        //no path, and no port
-        for(i = 0; i < realLen; i++){
-            hostName[i] = realHost[i];
-        }
-    }
-    else if(realHost[offset] == '/'){
-        //has path but no specified port
-        for(i = 0; i < offset; i++){
-	    hostName[i] = realHost[i];
+void lruHit(cacheShard *shard, cache *thisCache){
+	//LRU: move the object read to the head of the list
+	//readers only hold a read lock, so they take lruLock for it: this is
+	//what makes exact LRU costlier than the policies below
+	if(sharedLock(&shard->lruLock) < 0){
+		return;
 	}
-        for(i = 0; i < realLen - offset; i++){
-	    path[i] =  realHost[offset + i];
+	if(shard->head != thisCache){
+		unlinkList(shard, thisCache);
+		linkAfter(shard, NULL, thisCache);
 	}
-    }
-    else{
-        //has a specified port number
-	int numberEnd = offset + 1;
-        char portChar[MAXBUF] = {'\0'};
-	while(numberEnd < realLen && realHost[numberEnd] >= '0' && realHost[numberEnd] <= '9'){
-            portChar[numberEnd - offset - 1] = realHost[numberEnd];
-	    numberEnd ++;
+	pthread_mutex_unlock(&shard->lruLock);
+}
+
+void lruInsert(cacheShard *shard, cache *thisCache){
+	linkAfter(shard, NULL, thisCache);
+}
+
+cache* lruVictim(cacheShard *shard){
+	//LRU: the least recently read object is at the tail
+	return shard->tail;
+}
+
+void updateCache(cacheShard *shard, cache *thisCache){
+	//CLOCK and SIEVE: when a cache is read, set its reference bit
+	//the caller holds at least a read lock, so the object cannot go away;
+	//the bit is only ever stored atomically, so no write lock is needed
+
+	//ill-formed call
+	if(thisCache == NULL){
+		return;
 	}
-        if(numberEnd != realLen && realHost[numberEnd] != '/'){
-	    //ill-formed after port number
-	    return -1;
+
+	//skip the store if it is already set, to keep the line shared
+	if(!__atomic_load_n(&thisCache->referenced, __ATOMIC_RELAXED)){
+		__atomic_store_n(&thisCache->referenced, 1, __ATOMIC_RELAXED);
 	}
-        port = atoi(portChar);
-	for(i = 0; i < offset; i++){
-	    hostName[i] = realHost[i];
+}
+
+void clockInsert(cacheShard *shard, cache *thisCache){
+	//CLOCK: insert it just behind the hand, so that the hand reaches it
+	//last, i.e. after the hand in list order, or at the head if the hand
+	//is about to wrap to the tail
+	linkAfter(shard, shard->hand, thisCache);
+}
+
+void sieveInsert(cacheShard *shard, cache *thisCache){
+	//SIEVE: insert it at the head, wherever the hand is: new objects
+	//are reached by the hand sooner than under CLOCK, so those read only
+	//once go quickly, and the hand stays put among the old popular ones
+	linkAfter(shard, NULL, thisCache);
+}
+
+cache* clockVictim(cacheShard *shard){
+	//CLOCK and SIEVE: the hand sweeps from the tail towards the head,
+	//clearing reference bits, and stops at the first object whose bit
+	//is already clear
+	//each bit set by a read is cleared at most once, so this is O(1) amortized
+	cache *toDel = (shard->hand != NULL) ? shard->hand : shard->tail;
+	while(__atomic_load_n(&toDel->referenced, __ATOMIC_RELAXED)){
+		//give it a second chance
+		__atomic_store_n(&toDel->referenced, 0, __ATOMIC_RELAXED);
+		toDel = (toDel->prev != NULL) ? toDel->prev : shard->tail;
 	}
-	for(i = 0; i < realLen - numberEnd; i++){
-	    path[i] = realHost[numberEnd + i];
+	shard->hand = toDel;
+	return toDel;
+}
+
+//the eviction policies, the first is the default
+evictPolicy policies[] = {
+	{"clock", updateCache, clockInsert, clockVictim},
+	{"lru", lruHit, lruInsert, lruVictim},
+	{"sieve", updateCache, sieveInsert, clockVictim},
+	{NULL, NULL, NULL, NULL}
+};
+
+//the policy in use
+evictPolicy *cachePolicy = &policies[0];
+
+evictPolicy* findPolicy(char *name){
+	//find the eviction policy called name, NULL if there is none
+	evictPolicy *p;
+	for(p = policies; p->name != NULL; p++){
+		if(strcmp(p->name, name) == 0){
+			return p;
+		}
 	}
-    }
-    return port;
+	return NULL;
 }
 
-void* thread(void *vargp){
-	//the thread to process a request.
-	//vargp contains the integer value of connFd
-	//first read the client's request, and parse it
-	//check if it is in cache, if it is then simply return it
-	//otherwise connect to the server and wait for response
-	//then send back the response to client
-	
-	//detach thread
-	Pthread_detach(Pthread_self());
+//the TinyLFU admission filter: a count-min sketch of how often keys
+//are requested, SKETCH_DEPTH rows of SKETCH_WIDTH 4-bit saturating
+//counters (kept in bytes), halved every SKETCH_SAMPLE requests so that
+//it forgets old popularity
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 16384
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)
+#define SKETCH_MAX 15
 
-	//convert the vargp to integer form
-        int connFd = (int)((long)vargp);
+//whether a new object must be more frequent than its victim to get in
+int useAdmission = 0;
 
-	//write client request to buf
-        rio_t rioAsServer;
-        Rio_readinitb(&rioAsServer, connFd);
-        char buf[MAXBUF];
-        Rio_readlineb(&rioAsServer, buf, MAXBUF);
-        char method[MAXBUF] = {'\0'}, URL[MAXBUF] = {'\0'};
+//the counters, and the requests counted since they were last halved,
+//in the shared region in worker mode
+unsigned char localSketch[SKETCH_DEPTH][SKETCH_WIDTH];
+unsigned long localSketchCount = 0;
+unsigned char (*sketch)[SKETCH_WIDTH] = localSketch;
+unsigned long *sketchCount = &localSketchCount;
 
-	//parse buf into method and URL (and everything behind them is unimportant)
-        sscanf(buf, "%s%s", method, URL);
+int sketchIndex(unsigned long hash, int row){
+	//the counter of hash in row, by double hashing
+	unsigned long h2 = (hash >> 32) | 1;
+	return (int)((hash + row * h2 * 0x9e3779b97f4a7c15UL) >> 40) & (SKETCH_WIDTH - 1);
+}
 
-	//if not a GET or bad URL
-        if(strcmp(method, "GET") != 0 || strlen(URL) <= 7){
-		return NULL;
+void sketchAdd(unsigned long hash){
+	//count a request for hash
+	//counters are updated without a lock: a lost update only makes the
+	//estimate a little lower
+	int i;
+	for(i = 0; i < SKETCH_DEPTH; i++){
+		unsigned char *c = &sketch[i][sketchIndex(hash, i)];
+		if(__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX){
+			__atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if(__atomic_add_fetch(sketchCount, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE){
+		//age it: the thread that reached the sample halves every counter
+		for(i = 0; i < SKETCH_DEPTH; i++){
+			int j;
+			for(j = 0; j < SKETCH_WIDTH; j++){
+				__atomic_store_n(&sketch[i][j], __atomic_load_n(&sketch[i][j], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+			}
+		}
+		__atomic_store_n(sketchCount, 0, __ATOMIC_RELAXED);
 	}
+}
 
-	//get the required port by parsing URL
-        char hostName[MAXBUF] = {'\0'}, path[MAXBUF] = {'\0'};
-        int sendPort = parseURL(URL, hostName, path);
+int sketchEstimate(unsigned long hash){
+	//estimate how often hash was requested lately: the smallest of its counters
+	int i, est = SKETCH_MAX;
+	for(i = 0; i < SKETCH_DEPTH; i++){
+		int c = __atomic_load_n(&sketch[i][sketchIndex(hash, i)], __ATOMIC_RELAXED);
+		if(c < est){
+			est = c;
+		}
+	}
+	return est;
+}
 
-	//if return -1, meaning bad URL, do nothing
-        if(sendPort == -1) return NULL;
+cache* lookupCache(char *host, char *path, int port){
+	//look up the cache and pin the object found
+	//if hit: return the object, which the caller must release with
+	//releaseCache() when it is done with it
+	//otherwise, return NULL
 
-	//if path is empty, use a replacement of '/'
-	if(strlen(path) == 0){
-		path[0] = '/';
+	//hashing needs no lock
+	unsigned long start = nowUsec();
+	unsigned long hash = hashKey(host, path, port);
+	cacheShard *shard = getShard(hash);
+	if(useAdmission){
+		sketchAdd(hash);
 	}
 
-	//check if it is already in cache
-	cache* thisCache = readCache(hostName, path, sendPort, connFd);
-	if(thisCache != NULL){
-		//if it is in cache, update its timestamp, and return
-		updateCache(thisCache);
-		Close(connFd);
+	//first use a read lock on its shard
+	//a broken shared cache is not used any more
+	if(cacheBroken()){
+		countAdd(&getMetrics()->misses, 1);
 		return NULL;
 	}
+	sharedEnter();
+	pthread_rwlock_rdlock(&shard->lock);
 
-	//if not in cache, initiate a connection to the specified URL
-	char sP[MAXBUF] = {'\0'};
-	sprintf(sP, "%d", sendPort);
-	int clientFd;
-
-	//must lock it
-	P(&mtx);
-        clientFd = Open_clientfd(hostName, sP);
-	V(&mtx);
-
-	//write headers
-	char aHeader[MAXBUF] = {'\0'};
-	rio_t rioAsClient;
-	Rio_readinitb(&rioAsClient, clientFd);
-	//GET header
-	sprintf(aHeader, "GET %s HTTP/1.0\r\n", path);
-	Rio_writen(clientFd, aHeader, strlen(aHeader));
-	//HOST header
-	sprintf(aHeader, "Host: %s\r\n", hostName);
-	Rio_writen(clientFd, aHeader, strlen(aHeader));
-	//user agent header
-	Rio_writen(clientFd, (char*)user_agent_hdr, strlen(user_agent_hdr));
-	//connection and proxy-connection header
-	char CONN[256] = "Connection: close\r\n";
-	char pCONN[256] = "Proxy-Connection: close\r\n";
-	Rio_writen(clientFd, CONN, strlen(CONN));
-	Rio_writen(clientFd, pCONN, strlen(pCONN));
-	//header ender
-	Rio_writen(clientFd, "\r\n", 2);
-
-	//read the response, and determine whether it can be cached
-	//we read MAX_OBJECT_SIZE+1 bytes at once
-	//so it can be cached if and only if the first read is not full
-	char response[MAX_OBJECT_SIZE+1];
-	int readLen;
-	int canCache = 1;
-	while(1){
-	    readLen = Rio_readnb(&rioAsClient, response, MAX_OBJECT_SIZE+1);
-	    if(readLen > MAX_OBJECT_SIZE){
-		//if a read exceeds MAX_OBJECT_SIZE, then it cannot be chched!
-		canCache = 0;
-	    }
-	    if(readLen <= 0){
-		//reaches the EOF
-		break;
-	    }
-	    Rio_writen(connFd, response, readLen);
-            if(canCache){
-		//if can cache, add to cache and return
-		addToCache(hostName, path, sendPort, response, readLen);
-		break;
-	    }
+	cache *thisCache = findCache(shard, host, path, port, hash);
+
+	//if we find the object cached, pin it, and let the policy know it
+	//was read. a worker that cannot record the pin treats it as a miss
+	if(thisCache != NULL && pinRecord(thisCache, 0) < 0){
+		thisCache = NULL;
 	}
-	Close(connFd);
-	Close(clientFd);
-	return NULL;
+	if(thisCache != NULL){
+		__atomic_add_fetch(&thisCache->refCnt, 1, __ATOMIC_RELAXED);
+		cachePolicy->hit(shard, thisCache);
+	}
+
+	//unlock
+	pthread_rwlock_unlock(&shard->lock);
+	sharedLeave();
+	countAdd((thisCache != NULL) ? &getMetrics()->hits : &getMetrics()->misses, 1);
+
+	recordLatency(ST_LOOKUP, nowUsec() - start);
+	return thisCache;
 }
 
-int main(int argc, char **argv)
-{
-    //if no port is specified, return
-    if(argc < 2){
-	printf("Must specify a port number!\n");
-	return 0;
-    }
+void removeCache(cacheShard *shard, cache *toDel){
+	//delete a cache object from the list and the table of shard, and
+	//update the size of shard
+	//its reference from the shard now belongs to the caller
+	//we assume that when entering this function, there is already a write lock on shard
+	//it should only be used in addToCache()
 
-    //first initialize locks
-    pthread_t tid;
-    Sem_init(&mtx, 0, 1);
-    pthread_rwlock_init(&cacheRWLock, NULL);
-    Signal(SIGPIPE, SIG_IGN);
+	//the hand moves on to the next object (NULL means wrap to the tail)
+	if(shard->hand == toDel){
+		shard->hand = toDel->prev;
+	}
+
+	//first update cache size
+	shard->size -= toDel->charge;
+
+	//unlink it from its bucket
+	cache **link = &shard->table[toDel->hash & (CACHE_BUCKETS - 1)];
+	while(*link != toDel){
+		link = &((*link)->hNext);
+	}
+	*link = toDel->hNext;
+
+	//then from the list
+	unlinkList(shard, toDel);
+}
+
+//how fresh an object is
+#define FRESH 0	//fresh: serve it
+#define STALE_SERVE 1	//stale, but it may be served while it is revalidated in the background
+#define STALE 2	//stale: revalidate it before serving it
+
+int freshness(long expires, int swr, long now){
+	//how fresh an object fresh until expires, and servable for swr more
+	//seconds while it is revalidated, is at now
+	if(now < expires){
+		return FRESH;
+	}
+	return (now < expires + swr) ? STALE_SERVE : STALE;
+}
+
+int cacheFreshness(cache *thisCache){
+	//how fresh thisCache is now
+	return freshness(__atomic_load_n(&thisCache->expires, __ATOMIC_RELAXED),
+		__atomic_load_n(&thisCache->swr, __ATOMIC_RELAXED), time(NULL));
+}
+
+void refreshCache(cache *thisCache, long expires, int swr){
+	//a server confirmed that thisCache is still good: it is fresh again
+	//until expires, and its body stays where it is
+	__atomic_store_n(&thisCache->swr, swr, __ATOMIC_RELAXED);
+	__atomic_store_n(&thisCache->expires, expires, __ATOMIC_RELAXED);
+}
+
+//the queue of objects served stale, waiting for the revalidation
+//threads to refresh them; each holds a reference to its object.
+//when it is full, an object is not queued, and the next request serving
+//it stale tries again
+#define REVAL_THREADS 2
+#define REVAL_QUEUE 64
+
+cache *revalQueue[REVAL_QUEUE];
+int revalFront = 0, revalCount = 0;
+pthread_mutex_t revalMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t revalCond = PTHREAD_COND_INITIALIZER;
+
+void startRevalidation(cache *thisCache){
+	//queue thisCache, which the caller has pinned and just served stale,
+	//for revalidation in the background, unless it already is
+	//with workers, its reference is recorded as the one revalidating it,
+	//so the supervisor can clear revalidating if the worker dies
+	if(__atomic_exchange_n(&thisCache->revalidating, 1, __ATOMIC_ACQ_REL)){
+		return;
+	}
+	pthread_mutex_lock(&revalMutex);
+	sharedEnter();
+	if(revalCount == REVAL_QUEUE || pinRecord(thisCache, 1) < 0){
+		sharedLeave();
+		pthread_mutex_unlock(&revalMutex);
+		__atomic_store_n(&thisCache->revalidating, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	__atomic_add_fetch(&thisCache->refCnt, 1, __ATOMIC_RELAXED);
+	sharedLeave();
+	revalQueue[(revalFront + revalCount++) % REVAL_QUEUE] = thisCache;
+	pthread_cond_signal(&revalCond);
+	pthread_mutex_unlock(&revalMutex);
+}
+
+//the disk tier: objects evicted from memory are demoted to append-only
+//segment files of DISK_SEGMENT_SIZE bytes, mapped in memory, and the
+//oldest segment is dropped when the tier outgrows its size (in MB)
+#define DISK_SEGMENT_SIZE (4 << 20)
+#define DEFAULT_DISK_SIZE 256
+
+//number of buckets in the index of the disk tier, must be a power of 2
+#define DISK_BUCKETS 4096
+
+#define DISK_MAGIC 0x70726f78
+
+#if DISK_SEGMENT_SIZE < 2 * MAX_OBJECT_SIZE
+#error "a disk segment must be able to hold an object of MAX_OBJECT_SIZE"
+#endif
+
+struct dr{
+	//the header of an object in a segment, followed by the host and
+	//path strings, then headLen bytes of head and bodyLen bytes of body,
+	//padded to 8 bytes. expires and swr are the freshness of the object
+	//when it was demoted
+
+	unsigned magic;
+	int port;
+	int hostLen;
+	int pathLen;
+	int headLen;
+	int bodyLen;
+	long expires;
+	int swr;
+
+};
+
+typedef struct dr diskRecord;
+
+struct dg{
+	//a segment file of the disk tier, mapped at map.
+	//objects are only ever appended to it, at used, and it is dropped
+	//whole, oldest first, from the list chained by next.
+	//entries chains the index entries of its objects by sNext.
+	//refCnt counts the readers and writers working on its map: a dropped
+	//segment is dead, and only unmapped once they are done.
+
+	int id;
+	int fd;
+	char *map;
+	int used;
+	int refCnt;
+	int dead;
+	struct de *entries;
+	struct dg *next;
+
+};
+
+typedef struct dg diskSegment;
+
+struct de{
+	//an entry of the index of the disk tier, kept compact: the key is
+	//only checked against the record itself, at off in seg.
+	//hNext chains the entries of a bucket, sNext those of a segment.
+
+	unsigned long hash;
+	diskSegment *seg;
+	int off;
+	struct de *hNext, *sNext;
+
+};
+
+typedef struct de diskEntry;
+
+//the directory of the disk tier, NULL if it is off, and its size in bytes
+char *diskDir = NULL;
+long diskLimit = (long)DEFAULT_DISK_SIZE << 20;
+
+//the index and the segments, oldest first, and their counters
+//all protected by diskMutex
+diskEntry *diskTable[DISK_BUCKETS];
+diskSegment *diskOldest = NULL, *diskActive = NULL;
+long diskSize = 0;
+int diskNextId = 0;
+long diskObjects = 0;
+unsigned long diskHits = 0, diskMisses = 0, diskStores = 0;
+pthread_mutex_t diskMutex = PTHREAD_MUTEX_INITIALIZER;
+
+diskRecord* entryRecord(diskEntry *e){
+	//the record of the object of e
+	return (diskRecord*)(e->seg->map + e->off);
+}
+
+int diskMatch(diskEntry *e, char *host, char *path, int port, unsigned long hash){
+	//whether e is the entry of (host, path, port)
+	if(e->hash != hash){
+		return 0;
+	}
+	diskRecord *rec = entryRecord(e);
+	char *recHost = (char*)(rec + 1);
+	return rec->port == port && strcmp(recHost, host) == 0 && strcmp(recHost + rec->hostLen, path) == 0;
+}
+
+diskEntry** findDisk(char *host, char *path, int port, unsigned long hash){
+	//find the link to the entry of (host, path, port) in the index,
+	//which points to NULL if there is none
+	//the caller holds diskMutex
+	diskEntry **link = &diskTable[hash & (DISK_BUCKETS - 1)];
+	while(*link != NULL && !diskMatch(*link, host, path, port, hash)){
+		link = &((*link)->hNext);
+	}
+	return link;
+}
+
+void freeSegment(diskSegment *seg){
+	//unmap a segment, once it is dropped and nobody works on it
+	munmap(seg->map, DISK_SEGMENT_SIZE);
+	close(seg->fd);
+	free(seg);
+}
+
+void segmentName(char *buf, int id){
+	sprintf(buf, "%s/seg.%06d", diskDir, id);
+}
+
+diskSegment* openSegment(){
+	//create the next segment file and map it
+	//the caller holds diskMutex
+	char name[MAXLINE];
+	diskSegment *seg = calloc(1, sizeof(diskSegment));
+	if(seg == NULL){
+		return NULL;
+	}
+	seg->id = diskNextId++;
+	segmentName(name, seg->id);
+	seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(seg->fd < 0){
+		free(seg);
+		return NULL;
+	}
+	if(ftruncate(seg->fd, DISK_SEGMENT_SIZE) < 0
+		|| (seg->map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0)) == MAP_FAILED){
+		close(seg->fd);
+		unlink(name);
+		free(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+void dropSegment(){
+	//drop the oldest segment and the entries of its objects
+	//the caller holds diskMutex
+	diskSegment *seg = diskOldest;
+	char name[MAXLINE];
+	diskOldest = seg->next;
+	diskSize -= DISK_SEGMENT_SIZE;
+	while(seg->entries != NULL){
+		diskEntry *e = seg->entries;
+		diskEntry **link = &diskTable[e->hash & (DISK_BUCKETS - 1)];
+		while(*link != e){
+			link = &((*link)->hNext);
+		}
+		*link = e->hNext;
+		seg->entries = e->sNext;
+		free(e);
+		diskObjects--;
+	}
+	segmentName(name, seg->id);
+	unlink(name);
+	seg->dead = 1;
+	if(seg->refCnt == 0){
+		freeSegment(seg);
+	}
+}
+
+void unlinkDisk(diskEntry **link){
+	//remove the entry *link from the index and from its segment, whose
+	//map keeps the record until the segment is dropped
+	//the caller holds diskMutex
+	diskEntry *e = *link;
+	*link = e->hNext;
+	diskEntry **sLink = &e->seg->entries;
+	while(*sLink != e){
+		sLink = &((*sLink)->sNext);
+	}
+	*sLink = e->sNext;
+	free(e);
+	diskObjects--;
+}
+
+void unpinSegment(diskSegment *seg){
+	//drop a reference to seg taken by diskStore() or lookupDisk()
+	pthread_mutex_lock(&diskMutex);
+	int last = (--seg->refCnt == 0 && seg->dead);
+	pthread_mutex_unlock(&diskMutex);
+	if(last){
+		freeSegment(seg);
+	}
+}
+
+int diskInit(char *dir, long limitMB){
+	//set the disk tier up in dir, with room for limitMB megabytes
+	//the segments of an earlier run are removed
+	//return 0 on success, -1 on error
+	mkdir(dir, 0700);
+	DIR *d = opendir(dir);
+	if(d == NULL){
+		return -1;
+	}
+	diskDir = dir;
+	struct dirent *ent;
+	char name[MAXLINE];
+	while((ent = readdir(d)) != NULL){
+		if(strncmp(ent->d_name, "seg.", 4) == 0){
+			snprintf(name, sizeof(name), "%s/%s", dir, ent->d_name);
+			unlink(name);
+		}
+	}
+	closedir(d);
+	diskLimit = limitMB << 20;
+	if(diskLimit < 2 * DISK_SEGMENT_SIZE){
+		diskLimit = 2 * DISK_SEGMENT_SIZE;
+	}
+	return 0;
+}
+
+int recordLen(cache *thisCache){
+	//the size of the record of thisCache, with its padding
+	return (sizeof(diskRecord) + strlen(thisCache->host) + 1 + strlen(thisCache->path) + 1 + thisCache->size + 7) & ~7;
+}
+
+void fillRecord(diskRecord *rec, cache *thisCache){
+	//write the record of thisCache at rec, as a segment holds it
+	rec->magic = DISK_MAGIC;
+	rec->port = thisCache->port;
+	rec->hostLen = strlen(thisCache->host) + 1;
+	rec->pathLen = strlen(thisCache->path) + 1;
+	rec->headLen = thisCache->headLen;
+	rec->bodyLen = thisCache->size - thisCache->headLen;
+	rec->expires = __atomic_load_n(&thisCache->expires, __ATOMIC_RELAXED);
+	rec->swr = __atomic_load_n(&thisCache->swr, __ATOMIC_RELAXED);
+	char *p = (char*)(rec + 1);
+	memcpy(p, thisCache->host, rec->hostLen);
+	memcpy(p + rec->hostLen, thisCache->path, rec->pathLen);
+	memcpy(p + rec->hostLen + rec->pathLen, thisCache->content, thisCache->size);
+}
+
+void diskStore(cache *thisCache){
+	//demote an object evicted from memory to the disk tier, unless it is
+	//already there, as fresh. the caller holds a reference to it, but no lock
+	if(diskDir == NULL){
+		return;
+	}
+	int len = recordLen(thisCache);
+	long expires = __atomic_load_n(&thisCache->expires, __ATOMIC_RELAXED);
+
+	//reserve room at the end of the active segment, under the lock
+	pthread_mutex_lock(&diskMutex);
+	diskEntry *old = *findDisk(thisCache->host, thisCache->path, thisCache->port, thisCache->hash);
+	if(old != NULL && entryRecord(old)->expires >= expires){
+		pthread_mutex_unlock(&diskMutex);
+		return;
+	}
+	if(diskActive == NULL || diskActive->used + len > DISK_SEGMENT_SIZE){
+		diskSegment *seg = openSegment();
+		if(seg == NULL){
+			pthread_mutex_unlock(&diskMutex);
+			return;
+		}
+		if(diskActive != NULL){
+			diskActive->next = seg;
+		}
+		else{
+			diskOldest = seg;
+		}
+		diskActive = seg;
+		diskSize += DISK_SEGMENT_SIZE;
+		while(diskSize > diskLimit){
+			dropSegment();
+		}
+	}
+	diskSegment *seg = diskActive;
+	int off = seg->used;
+	seg->used += len;
+	seg->refCnt++;
+	pthread_mutex_unlock(&diskMutex);
+
+	//copy it in without the lock, nobody can see it yet
+	diskRecord *rec = (diskRecord*)(seg->map + off);
+	fillRecord(rec, thisCache);
+
+	//then index it, unless its segment was dropped meanwhile
+	//or another thread was faster. it replaces an older copy
+	diskEntry *e = malloc(sizeof(diskEntry));
+	pthread_mutex_lock(&diskMutex);
+	diskEntry **link = findDisk(thisCache->host, thisCache->path, thisCache->port, thisCache->hash);
+	if(e != NULL && !seg->dead && *link != NULL && entryRecord(*link)->expires < rec->expires){
+		unlinkDisk(link);
+		link = findDisk(thisCache->host, thisCache->path, thisCache->port, thisCache->hash);
+	}
+	if(e != NULL && !seg->dead && *link == NULL){
+		e->hash = thisCache->hash;
+		e->seg = seg;
+		e->off = off;
+		e->hNext = NULL;
+		*link = e;
+		e->sNext = seg->entries;
+		seg->entries = e;
+		diskObjects++;
+		diskStores++;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&diskMutex);
+	free(e);
+	unpinSegment(seg);
+}
+
+diskRecord* lookupDisk(char *host, char *path, int port, diskSegment **segp){
+	//look up the disk tier and pin the segment of the object found
+	//if hit: return its record, and its segment in *segp, which the
+	//caller must unpin with unpinSegment() when it is done with it
+	//otherwise, return NULL
+	if(diskDir == NULL){
+		return NULL;
+	}
+	unsigned long hash = hashKey(host, path, port);
+	diskRecord *rec = NULL;
+	pthread_mutex_lock(&diskMutex);
+	diskEntry *e = *findDisk(host, path, port, hash);
+	if(e != NULL){
+		e->seg->refCnt++;
+		*segp = e->seg;
+		rec = entryRecord(e);
+		diskHits++;
+	}
+	else{
+		diskMisses++;
+	}
+	pthread_mutex_unlock(&diskMutex);
+	return rec;
+}
+
+int onDisk(char *host, char *path, int port){
+	//whether the disk tier holds an object, from its index alone, so
+	//without touching a segment
+	//a miss is counted here, a hit by the lookupDisk() that follows
+	if(diskDir == NULL){
+		return 0;
+	}
+	unsigned long hash = hashKey(host, path, port);
+	pthread_mutex_lock(&diskMutex);
+	int found = (*findDisk(host, path, port, hash) != NULL);
+	if(!found){
+		diskMisses++;
+	}
+	pthread_mutex_unlock(&diskMutex);
+	return found;
+}
+
+int admitCache(cacheShard *shard, cache *newCache, cache *replaced){
+	//TinyLFU: whether newCache gets into shard, where it replaces
+	//replaced unless that is NULL, i.e. whether it was requested more often
+	//than each object the policy would evict to make room for it
+	//the victims are found by walking the list in the order the policy
+	//evicts, without evicting anything or clearing any bit: from the hand
+	//of CLOCK and SIEVE, the objects whose bit is clear come first, then
+	//the others, as the sweep would clear their bits; LRU sets no bits,
+	//so it just takes them from the tail
+	//the caller holds the write lock on shard
+	long room = MAX_CACHE_SIZE / CACHE_SHARDS - shard->size - newCache->charge;
+	cache *start = (shard->hand != NULL) ? shard->hand : shard->tail;
+	int est = sketchEstimate(newCache->hash), lap;
+	if(replaced != NULL){
+		room += replaced->charge;
+	}
+	for(lap = 0; lap < 2 && room < 0 && start != NULL; lap++){
+		cache *thisCache = start;
+		do{
+			if(thisCache != replaced && (lap == 1) == (__atomic_load_n(&thisCache->referenced, __ATOMIC_RELAXED) != 0)){
+				if(est <= sketchEstimate(thisCache->hash)){
+					return 0;
+				}
+				room += thisCache->charge;
+				if(room >= 0){
+					return 1;
+				}
+			}
+			thisCache = (thisCache->prev != NULL) ? thisCache->prev : shard->tail;
+		}while(thisCache != start);
+	}
+	return 1;
+}
+
+void addToCache(char *host, char *path, int port, char *head, int headLen, char *response, int readLen, long expires, int swr){
+	//add a new object to cache
+	//its response is the head kept from the server and the body in response
+	//it is fresh until expires, and then servable for swr seconds while
+	//it is revalidated
+	//it replaces a staler copy of the same object
+
+	//if bad form or too long, just ignore
+	//in fact this cannot happen, we explicitly check it before calling this func
+	//a head is copied into MAXBUF buffers when it is served, so a longer
+	//one must never get in
+	if(response == NULL || readLen < 0 || readLen > MAX_OBJECT_SIZE || headLen < 0 || headLen > MAX_HEAD_SIZE){
+		return;
+	}
+
+	//an object charging more than a whole shard can never fit
+	int hostLen = strlen(host) + 1, pathLen = strlen(path) + 1;
+	int size = headLen + readLen;
+	int charge = sizeof(cache) + size + hostLen + pathLen;
+	if(charge > MAX_CACHE_SIZE / CACHE_SHARDS || cacheBroken()){
+		return;
+	}
+
+	//prepare the cache object, in one allocation of exactly charge bytes
+	//from the heap, or from the arena of its shard when it is shared
+	//it is pinned by this thread until it is linked
+	unsigned long hash = hashKey(host, path, port);
+	cacheShard *shard = getShard(hash);
+	sharedEnter();
+	cache *newCache = cacheAlloc(shard, charge);
+	if(newCache != NULL){
+		newCache->hash = hash;
+		newCache->refCnt = 1;
+		pinRecord(newCache, 0);
+	}
+	sharedLeave();
+	if(newCache == NULL){
+		return;
+	}
+	memcpy(newCache->content, head, headLen);
+	memcpy(newCache->content + headLen, response, readLen);
+	newCache->host = newCache->content + size;
+	memcpy(newCache->host, host, hostLen);
+	newCache->path = newCache->host + hostLen;
+	memcpy(newCache->path, path, pathLen);
+	newCache->port = port;
+	newCache->size = size;
+	newCache->headLen = headLen;
+	newCache->charge = charge;
+	newCache->referenced = 0;
+	newCache->expires = expires;
+	newCache->swr = swr;
+	newCache->revalidating = 0;
+
+	//begin our transaction, first write lock on the shard
+	sharedEnter();
+	pthread_rwlock_wrlock(&shard->lock);
+
+	//another thread may have cached the same object meanwhile, or this
+	//is a new copy of a stale one
+	cache *replaced = findCache(shard, host, path, port, newCache->hash);
+	if(replaced != NULL && __atomic_load_n(&replaced->expires, __ATOMIC_RELAXED) >= expires){
+		pthread_rwlock_unlock(&shard->lock);
+		sharedLeave();
+		releaseCache(newCache);
+		return;
+	}
+
+	//with admission, the new object only gets in if it was requested
+	//more often than each victim: a scan cannot flush the hot objects
+	//it is decided before anything is evicted, so a refused object
+	//leaves the shard as it was, with the copy it would have replaced
+	int admitted = !useAdmission || admitCache(shard, newCache, replaced);
+	cache *evicted = NULL;
+	int nEvicted = 0;
+	if(admitted){
+		//the references of the shard to the objects it removes now
+		//belong to this thread, and are pinned by it
+		if(replaced != NULL){
+			removeCache(shard, replaced);
+			pinRecord(replaced, 0);
+		}
+
+		//evict older blocks to fit the budget of the shard, as the policy
+		//picks them. they are chained by hNext, which is free once they
+		//are unlinked
+		while(shard->size > MAX_CACHE_SIZE / CACHE_SHARDS - charge){
+			cache *toDel = cachePolicy->victim(shard);
+			removeCache(shard, toDel);
+			pinRecord(toDel, 0);
+			nEvicted++;
+			toDel->hNext = evicted;
+			evicted = toDel;
+		}
+
+		//link it as the policy wants, and its reference goes to the shard
+		pinForget(newCache, 0);
+		cachePolicy->insert(shard, newCache);
+		shard->size += charge;
+
+		//and to the head of its bucket
+		cache **bucket = &shard->table[newCache->hash & (CACHE_BUCKETS - 1)];
+		newCache->hNext = *bucket;
+		*bucket = newCache;
+	}
+
+	//unlock
+	pthread_rwlock_unlock(&shard->lock);
+	sharedLeave();
+	countAdd(&getMetrics()->evictions, nEvicted);
+	if(!admitted){
+		countAdd(&getMetrics()->rejected, 1);
+		releaseCache(newCache);
+	}
+	else if(replaced != NULL){
+		releaseCache(replaced);
+	}
+
+	//demote the evicted objects to disk, out of the lock, then drop the
+	//references of the shard: readers still streaming them keep them
+	//alive until they are done
+	while(evicted != NULL){
+		cache *toDel = evicted;
+		evicted = toDel->hNext;
+		diskStore(toDel);
+		releaseCache(toDel);
+	}
+}
+
+//the snapshot of the cache: its objects are written to snapshotPath on
+//shutdown, and every snapshotInterval seconds if it is set, and loaded
+//back at startup, so that a restarted proxy has its hot set at once
+#define SNAPSHOT_MAGIC 0x736e6170
+
+struct sh{
+	//the header of a snapshot file, followed by count objects as records
+	//of the disk tier, shard by shard, each shard from the tail of its
+	//list to its head: inserting them in this order rebuilds the lists.
+	//size is the size of the whole file, to tell a truncated one
+
+	unsigned magic;
+	int count;
+	long size;
+
+};
+
+typedef struct sh snapshotHeader;
+
+char *snapshotPath = NULL;
+int snapshotInterval = 0;
+pthread_mutex_t snapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//how long the snapshot waits in all for the locks of shards (in seconds):
+//with workers, one that died holding them would otherwise block it for good
+#define SNAPSHOT_LOCK_WAIT 2
+
+int lockShard(cacheShard *shard, struct timespec *until){
+	//take a read lock on shard and its lruLock, for the snapshot
+	//return 0 on success, -1 if they are not free by until
+	if(pthread_rwlock_timedrdlock(&shard->lock, until) != 0){
+		return -1;
+	}
+	int rc = pthread_mutex_timedlock(&shard->lruLock, until);
+	if(rc == EOWNERDEAD){
+		__atomic_store_n(sharedBroken, 1, __ATOMIC_RELAXED);
+		pthread_mutex_consistent(&shard->lruLock);
+		pthread_mutex_unlock(&shard->lruLock);
+	}
+	if(rc != 0){
+		pthread_rwlock_unlock(&shard->lock);
+		return -1;
+	}
+	return 0;
+}
+
+int saveSnapshot(){
+	//write the objects of the cache to snapshotPath
+	//the objects of a shard are pinned under its lock and written without
+	//it, so the cache keeps serving meanwhile. the file is written aside
+	//and then renamed, so a snapshot is never left half written
+	//return the number of objects written, -1 on error
+	char tmp[MAXLINE];
+	snapshotHeader hdr;
+	struct timespec until;
+	int i, n, fd, ok = 1;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += SNAPSHOT_LOCK_WAIT;
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.count = 0;
+	hdr.size = sizeof(hdr);
+	if(cacheBroken()){
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", snapshotPath);
+	pthread_mutex_lock(&snapshotMutex);
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0){
+		pthread_mutex_unlock(&snapshotMutex);
+		return -1;
+	}
+	ok = rio_writen(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+	for(i = 0; ok && i < CACHE_SHARDS; i++){
+		cacheShard *shard = &cacheShards[i];
+		cache *thisCache, **pinned;
+		int count;
+
+		//pin the objects of the shard, coldest first
+		//LRU readers move objects in the list under the read lock, holding
+		//lruLock: it is taken too, so the list holds still for both walks
+		//a shard whose locks stay held fails it, and the last snapshot
+		//stays in place
+		if(lockShard(shard, &until) < 0){
+			fprintf(stderr, "shard %d stays locked, the snapshot is not written\n", i);
+			ok = 0;
+			break;
+		}
+		for(count = 0, thisCache = shard->head; thisCache != NULL; thisCache = thisCache->next){
+			count++;
+		}
+		pinned = malloc((count + 1) * sizeof(cache*));
+		for(n = 0, thisCache = shard->tail; pinned != NULL && thisCache != NULL && n < count; thisCache = thisCache->prev){
+			__atomic_add_fetch(&thisCache->refCnt, 1, __ATOMIC_RELAXED);
+			pinned[n++] = thisCache;
+		}
+		pthread_mutex_unlock(&shard->lruLock);
+		pthread_rwlock_unlock(&shard->lock);
+		if(pinned == NULL){
+			ok = 0;
+			break;
+		}
+
+		//then write them out
+		int j;
+		for(j = 0; j < n; j++){
+			int len = recordLen(pinned[j]);
+			diskRecord *rec = calloc(1, len);
+			if(ok && rec != NULL){
+				fillRecord(rec, pinned[j]);
+				ok = rio_writen(fd, rec, len) == len;
+				hdr.count++;
+				hdr.size += len;
+			}
+			free(rec);
+			releaseCache(pinned[j]);
+		}
+		free(pinned);
+	}
+	ok = ok && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && fsync(fd) == 0;
+	ok = (close(fd) == 0) && ok;
+	ok = ok && rename(tmp, snapshotPath) == 0;
+	if(!ok){
+		unlink(tmp);
+	}
+	pthread_mutex_unlock(&snapshotMutex);
+	return ok ? hdr.count : -1;
+}
+
+int loadSnapshot(){
+	//load the objects of the snapshot at snapshotPath into the cache
+	//the file is mapped, and its objects copied in as they come
+	//return the number of objects loaded, -1 if there is no good snapshot
+	int fd = open(snapshotPath, O_RDONLY);
+	struct stat st;
+	if(fd < 0){
+		return -1;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snapshotHeader)){
+		close(fd);
+		return -1;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		return -1;
+	}
+	snapshotHeader *hdr = (snapshotHeader*)map;
+	if(hdr->magic != SNAPSHOT_MAGIC || hdr->size != st.st_size){
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	//check each record before using it: the file is not to be trusted
+	long off = sizeof(snapshotHeader);
+	int i;
+	for(i = 0; i < hdr->count && off + (long)sizeof(diskRecord) <= st.st_size; i++){
+		diskRecord *rec = (diskRecord*)(map + off);
+		char *host = (char*)(rec + 1), *path = host + rec->hostLen, *head = path + rec->pathLen;
+		long len = ((long)sizeof(diskRecord) + rec->hostLen + rec->pathLen + rec->headLen + rec->bodyLen + 7) & ~7L;
+		if(rec->magic != DISK_MAGIC || rec->hostLen <= 0 || rec->pathLen <= 0 || rec->headLen < 0
+			|| rec->headLen > MAX_HEAD_SIZE || rec->bodyLen < 0 || rec->bodyLen > MAX_OBJECT_SIZE || off + len > st.st_size
+			|| host[rec->hostLen - 1] != '\0' || path[rec->pathLen - 1] != '\0'){
+			break;
+		}
+		addToCache(host, path, rec->port, head, rec->headLen, head + rec->headLen, rec->bodyLen, rec->expires, rec->swr);
+		off += len;
+	}
+	munmap(map, st.st_size);
+	return i;
+}
+
+void* snapshotThread(void *vargp){
+	//write a snapshot every snapshotInterval seconds
+	Pthread_detach(Pthread_self());
+	while(1){
+		sleep(snapshotInterval);
+		saveSnapshot();
+	}
+	return NULL;
+}
+
+//max number of headers in a request
+#define MAX_HEADERS 64
+
+//states of the request parser
+#define REQ_LINE 0	//before the request line
+#define REQ_HEADERS 1	//among the headers
+#define REQ_DONE 2	//the whole head is parsed
+
+struct sl{
+	//a slice of a buffer: len bytes at p, not NUL-terminated
+
+	char *p;
+	int len;
+
+};
+
+typedef struct sl slice;
+
+struct hq{
+	//a request parsed from a buffer, as slices into that buffer.
+	//the parser is incremental: parsed is how far it got, always at the
+	//start of a line, and a call with more bytes in the buffer goes on
+	//from there, so a head may arrive in any number of reads.
+	//the URI is split into host, port and path for the absolute form
+	//(path is empty for "http://host"), and is only in uri otherwise.
+	//lines holds each header line whole, with its line end, for
+	//forwarding, and names and values their parts.
+	//headLen is the length of the head, once it is all parsed.
+
+	int state;
+	int parsed;
+	slice method, uri, version;
+	slice host, path;
+	int port;
+	int absolute;
+	slice lines[MAX_HEADERS], names[MAX_HEADERS], values[MAX_HEADERS];
+	int nHeaders;
+	int keepAlive;
+	int headLen;
+
+};
+
+typedef struct hq httpRequest;
+
+int sliceEquals(slice s, char *str){
+	//whether s is str
+	return (int)strlen(str) == s.len && memcmp(s.p, str, s.len) == 0;
+}
+
+int sliceIs(slice s, char *str){
+	//whether s is str, ignoring case, as header names are compared
+	return (int)strlen(str) == s.len && strncasecmp(s.p, str, s.len) == 0;
+}
+
+int sliceHas(slice s, char *token){
+	//whether the comma-separated list s has token, ignoring case
+	int len = strlen(token), i = 0;
+	while(i < s.len){
+		while(i < s.len && (s.p[i] == ' ' || s.p[i] == '\t' || s.p[i] == ',')){
+			i++;
+		}
+		int start = i;
+		while(i < s.len && s.p[i] != ',' && s.p[i] != ' ' && s.p[i] != '\t'){
+			i++;
+		}
+		if(i - start == len && strncasecmp(s.p + start, token, len) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int sliceCopy(char *dst, int size, slice s){
+	//copy s into dst of size bytes as a string
+	//return 0, or -1 if it does not fit
+	if(s.len >= size){
+		return -1;
+	}
+	memcpy(dst, s.p, s.len);
+	dst[s.len] = '\0';
+	return 0;
+}
+
+void requestInit(httpRequest *r){
+	//start parsing a new request
+	r->state = REQ_LINE;
+	r->parsed = 0;
+	r->nHeaders = 0;
+	r->absolute = 0;
+	r->port = 80;
+	r->path.p = r->host.p = NULL;
+	r->path.len = r->host.len = 0;
+}
+
+int nextToken(char **p, char *end, slice *s){
+	//take the token at *p, up to a space or end, into s, and move *p past
+	//the spaces after it
+	//return 0, or -1 if it is empty
+	s->p = *p;
+	while(*p < end && **p != ' '){
+		(*p)++;
+	}
+	s->len = *p - s->p;
+	while(*p < end && **p == ' '){
+		(*p)++;
+	}
+	return (s->len > 0) ? 0 : -1;
+}
+
+int parseURI(httpRequest *r){
+	//split an absolute URI, http://host[:port][/path], into host, port
+	//and path; other forms are left in uri
+	//return 0, or -1 if it is ill-formed
+	slice u = r->uri;
+	if(u.len < 7 || strncasecmp(u.p, "http://", 7) != 0){
+		return 0;
+	}
+	char *p = u.p + 7, *end = u.p + u.len;
+	r->absolute = 1;
+	r->host.p = p;
+	while(p < end && *p != ':' && *p != '/'){
+		p++;
+	}
+	r->host.len = p - r->host.p;
+	if(r->host.len == 0){
+		return -1;
+	}
+	if(p < end && *p == ':'){
+		int port = 0;
+		p++;
+		if(p == end || *p == '/'){
+			return -1;
+		}
+		while(p < end && *p >= '0' && *p <= '9'){
+			port = port * 10 + (*p - '0');
+			if(port > 65535){
+				return -1;
+			}
+			p++;
+		}
+		if(p < end && *p != '/'){
+			return -1;
+		}
+		r->port = port;
+	}
+	r->path.p = p;
+	r->path.len = end - p;
+	return 0;
+}
+
+int parseRequest(httpRequest *r, char *buf, int len){
+	//parse the request whose head is at the start of the len bytes in buf,
+	//going on from where the last call stopped: buf may have grown since,
+	//but what was parsed must be where it was
+	//return 1 once the head is all parsed, 0 if more bytes are needed,
+	//-1 if it is ill-formed
+	while(r->state != REQ_DONE){
+		char *line = buf + r->parsed;
+		char *nl = memchr(line, '\n', len - r->parsed);
+		if(nl == NULL){
+			return 0;
+		}
+		char *end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+		r->parsed = nl + 1 - buf;
+
+		if(r->state == REQ_LINE){
+			//empty lines before the request line are skipped
+			if(end == line){
+				continue;
+			}
+			char *p = line;
+			if(nextToken(&p, end, &r->method) < 0 || nextToken(&p, end, &r->uri) < 0
+				|| nextToken(&p, end, &r->version) < 0 || p != end || parseURI(r) < 0){
+				return -1;
+			}
+			r->state = REQ_HEADERS;
+			continue;
+		}
+
+		if(end == line){
+			//the end of the head
+			r->headLen = r->parsed;
+			r->state = REQ_DONE;
+			break;
+		}
+		if(*line == ' ' || *line == '\t' || r->nHeaders == MAX_HEADERS){
+			//a folded line, which is obsolete, or too many headers
+			return -1;
+		}
+		char *colon = memchr(line, ':', end - line);
+		if(colon == NULL || colon == line){
+			return -1;
+		}
+		char *v = colon + 1, *vEnd = end;
+		while(v < vEnd && (*v == ' ' || *v == '\t')){
+			v++;
+		}
+		while(vEnd > v && (vEnd[-1] == ' ' || vEnd[-1] == '\t')){
+			vEnd--;
+		}
+		int i = r->nHeaders++;
+		r->lines[i].p = line;
+		r->lines[i].len = nl + 1 - line;
+		r->names[i].p = line;
+		r->names[i].len = colon - line;
+		r->values[i].p = v;
+		r->values[i].len = vEnd - v;
+	}
+
+	//HTTP/1.1 connections persist unless told otherwise
+	int i;
+	r->keepAlive = sliceIs(r->version, "HTTP/1.1");
+	for(i = 0; i < r->nHeaders; i++){
+		if(sliceIs(r->names[i], "Connection") || sliceIs(r->names[i], "Proxy-Connection")){
+			if(sliceHas(r->values[i], "close")){
+				r->keepAlive = 0;
+			}
+			else if(sliceHas(r->values[i], "keep-alive")){
+				r->keepAlive = 1;
+			}
+		}
+	}
+	return 1;
+}
+
+slice* requestHeader(httpRequest *r, char *name){
+	//the value of the header name of r, NULL if it has none
+	int i;
+	for(i = 0; i < r->nHeaders; i++){
+		if(sliceIs(r->names[i], name)){
+			return &r->values[i];
+		}
+	}
+	return NULL;
+}
+
+int forwardHeader(httpRequest *r, int i){
+	//whether header i of r is forwarded to the server as it is
+	//the proxy writes its own Host and User-Agent, and the headers that
+	//only apply to the connection from the client are dropped: the
+	//hop-by-hop ones, and any that Connection names
+	static char *names[] = {"Host", "User-Agent", "Connection", "Proxy-Connection",
+		"Keep-Alive", "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Proxy-Authorization", NULL};
+	int j;
+	for(j = 0; names[j] != NULL; j++){
+		if(sliceIs(r->names[i], names[j])){
+			return 0;
+		}
+	}
+	for(j = 0; j < r->nHeaders; j++){
+		if(sliceIs(r->names[j], "Connection")){
+			char name[MAXLINE];
+			if(sliceCopy(name, sizeof(name), r->names[i]) == 0 && sliceHas(r->values[j], name)){
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+void queueInit(connQueue *q, int n){
+	//create an empty queue with n slots
+	q->fds = Calloc(n, sizeof(int));
+	q->queuedAt = Calloc(n, sizeof(unsigned long));
+	q->n = n;
+	q->front = q->rear = 0;
+	Sem_init(&q->mutex, 0, 1);
+	Sem_init(&q->slots, 0, n);
+	Sem_init(&q->items, 0, 0);
+	q->depth = q->maxDepth = 0;
+	q->dequeued = 0;
+	q->totalWait = q->maxWait = 0;
+}
+
+void queueInsert(connQueue *q, int connFd){
+	//queue a connection, waiting for a free slot if it is full
+	P(&q->slots);
+	P(&q->mutex);
+	q->fds[q->rear] = connFd;
+	q->queuedAt[q->rear] = nowUsec();
+	q->rear = (q->rear + 1) % q->n;
+	q->depth++;
+	if(q->depth > q->maxDepth){
+		q->maxDepth = q->depth;
+	}
+	V(&q->mutex);
+	V(&q->items);
+}
+
+int queueRemove(connQueue *q){
+	//take the oldest connection off the queue, waiting if it is empty
+	P(&q->items);
+	P(&q->mutex);
+	int connFd = q->fds[q->front];
+	unsigned long wait = nowUsec() - q->queuedAt[q->front];
+	q->front = (q->front + 1) % q->n;
+	q->depth--;
+	q->dequeued++;
+	q->totalWait += wait;
+	if(wait > q->maxWait){
+		q->maxWait = wait;
+	}
+	V(&q->mutex);
+	V(&q->slots);
+	return connFd;
+}
+
+unsigned long histPercentile(unsigned long *hist, unsigned long count, double pct){
+	//the value under which pct percent of the count values in hist fall
+	unsigned long want = (unsigned long)(count * pct / 100.0 + 0.5), seen = 0;
+	int i;
+	if(want == 0){
+		want = 1;
+	}
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += hist[i];
+		if(seen >= want){
+			return histValue(i);
+		}
+	}
+	return histValue(HIST_BUCKETS - 1);
+}
+
+void printStats(FILE *fp){
+	//dump the counters of the proxy to fp
+	//the counters of the threads are merged here, when they are read
+	static char *stageNames[N_STAGES] = {"parse", "lookup", "connect", "first byte", "transfer"};
+	connQueue *q = &connQ;
+	if(q->fds != NULL){
+		P(&q->mutex);
+		fprintf(fp, "queue: depth %d/%d, max depth %d, dequeued %lu, avg wait %lu us, max wait %lu us\n",
+			q->depth, q->n, q->maxDepth, q->dequeued,
+			q->dequeued ? q->totalWait / q->dequeued : 0, q->maxWait);
+		V(&q->mutex);
+	}
+
+	metrics *sum = calloc(1, sizeof(metrics)), *m;
+	if(sum != NULL){
+		int stage, i;
+		pthread_mutex_lock(&metricsMutex);
+		for(m = allMetrics; m != NULL; m = m->next){
+			sum->requests += __atomic_load_n(&m->requests, __ATOMIC_RELAXED);
+			sum->cacheBytes += __atomic_load_n(&m->cacheBytes, __ATOMIC_RELAXED);
+			sum->originBytes += __atomic_load_n(&m->originBytes, __ATOMIC_RELAXED);
+			sum->upstreamRequests += __atomic_load_n(&m->upstreamRequests, __ATOMIC_RELAXED);
+			sum->upstreamCalls += __atomic_load_n(&m->upstreamCalls, __ATOMIC_RELAXED);
+			sum->staleServed += __atomic_load_n(&m->staleServed, __ATOMIC_RELAXED);
+			sum->revalidations += __atomic_load_n(&m->revalidations, __ATOMIC_RELAXED);
+			sum->notModified += __atomic_load_n(&m->notModified, __ATOMIC_RELAXED);
+			sum->timeouts += __atomic_load_n(&m->timeouts, __ATOMIC_RELAXED);
+			sum->idleEvicted += __atomic_load_n(&m->idleEvicted, __ATOMIC_RELAXED);
+			sum->partial += __atomic_load_n(&m->partial, __ATOMIC_RELAXED);
+			sum->unsatisfiable += __atomic_load_n(&m->unsatisfiable, __ATOMIC_RELAXED);
+			sum->hits += __atomic_load_n(&m->hits, __ATOMIC_RELAXED);
+			sum->misses += __atomic_load_n(&m->misses, __ATOMIC_RELAXED);
+			sum->evictions += __atomic_load_n(&m->evictions, __ATOMIC_RELAXED);
+			sum->rejected += __atomic_load_n(&m->rejected, __ATOMIC_RELAXED);
+			for(stage = 0; stage < N_STAGES; stage++){
+				for(i = 0; i < HIST_BUCKETS; i++){
+					sum->hist[stage][i] += __atomic_load_n(&m->hist[stage][i], __ATOMIC_RELAXED);
+				}
+			}
+		}
+		pthread_mutex_unlock(&metricsMutex);
+		fprintf(fp, "requests: %lu, active connections %ld, bytes from cache %lu, from servers %lu\n",
+			sum->requests, __atomic_load_n(&activeConns, __ATOMIC_RELAXED), sum->cacheBytes, sum->originBytes);
+		fprintf(fp, "upstream: requests %lu, sent in %lu system calls, %.2f per request\n",
+			sum->upstreamRequests, sum->upstreamCalls,
+			sum->upstreamRequests ? (double)sum->upstreamCalls / sum->upstreamRequests : 0.0);
+		fprintf(fp, "freshness: stale served %lu, revalidations %lu, not modified %lu\n",
+			sum->staleServed, sum->revalidations, sum->notModified);
+		fprintf(fp, "deadlines: read %d s, write %d s, timed out %lu, idle clients evicted %lu\n",
+			readTimeout, writeTimeout, sum->timeouts, sum->idleEvicted);
+		fprintf(fp, "ranges: partial from cache %lu, unsatisfiable %lu\n", sum->partial, sum->unsatisfiable);
+		fprintf(fp, "cache: policy %s%s, hits %lu, misses %lu, hit ratio %.2f%%, evictions %lu, rejected %lu\n",
+			cachePolicy->name, useAdmission ? "+tinylfu" : "", sum->hits, sum->misses,
+			(sum->hits + sum->misses) ? 100.0 * sum->hits / (sum->hits + sum->misses) : 0.0, sum->evictions, sum->rejected);
+		for(stage = 0; stage < N_STAGES; stage++){
+			unsigned long count = 0, max = 0;
+			for(i = 0; i < HIST_BUCKETS; i++){
+				count += sum->hist[stage][i];
+				if(sum->hist[stage][i] != 0){
+					max = histValue(i);
+				}
+			}
+			if(count == 0){
+				continue;
+			}
+			fprintf(fp, "latency %s: count %lu, p50 %lu us, p90 %lu us, p99 %lu us, p999 %lu us, max %lu us\n",
+				stageNames[stage], count,
+				histPercentile(sum->hist[stage], count, 50), histPercentile(sum->hist[stage], count, 90),
+				histPercentile(sum->hist[stage], count, 99), histPercentile(sum->hist[stage], count, 99.9), max);
+		}
+		free(sum);
+	}
+	if(diskDir != NULL){
+		pthread_mutex_lock(&diskMutex);
+		fprintf(fp, "disk: %ld objects in %ld/%ld MB, hits %lu, misses %lu, stores %lu\n",
+			diskObjects, diskSize >> 20, diskLimit >> 20, diskHits, diskMisses, diskStores);
+		pthread_mutex_unlock(&diskMutex);
+	}
+	fflush(fp);
+}
+
+//dump the counters every statsInterval seconds, 0 to only dump them on SIGUSR1
+int statsInterval = 0;
+
+void* statsThread(void *vargp){
+	//wait for SIGUSR1, and dump the counters to stderr on each one,
+	//and every statsInterval seconds if it is set
+	//with a snapshot, also wait for SIGTERM and SIGINT, to write it
+	//before exiting, and in a worker, to exit holding no shared lock
+	//in a worker, it also beats every second, for the supervisor
+	//these are blocked in every thread, so they are only taken here
+	Pthread_detach(Pthread_self());
+	sigset_t set;
+	struct timespec timeout;
+	long nextStats = nowSec() + statsInterval;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if(snapshotPath != NULL || reusePort){
+		sigaddset(&set, SIGTERM);
+		sigaddset(&set, SIGINT);
+	}
+	timeout.tv_sec = (thisWorker != NULL) ? 1 : statsInterval;
+	timeout.tv_nsec = 0;
+	while(1){
+		int sig = (statsInterval > 0 || thisWorker != NULL) ? sigtimedwait(&set, NULL, &timeout) : sigwaitinfo(&set, NULL);
+		if(thisWorker != NULL){
+			__atomic_store_n(&thisWorker->beat, nowSec(), __ATOMIC_RELAXED);
+		}
+		if(sig < 0 && errno == EAGAIN && (statsInterval == 0 || nowSec() < nextStats)){
+			continue;
+		}
+		if(sig == SIGUSR1 || (sig < 0 && errno == EAGAIN)){
+			printStats(stderr);
+			nextStats = nowSec() + statsInterval;
+		}
+		else if((sig == SIGTERM || sig == SIGINT) && reusePort){
+			stopWorker();
+		}
+		else if(sig == SIGTERM || sig == SIGINT){
+			if(saveSnapshot() < 0){
+				fprintf(stderr, "cannot write the snapshot to %s\n", snapshotPath);
+			}
+			exit(0);
+		}
+	}
+	return NULL;
+}
+
+//how long resolved addresses are cached, and failures to resolve (in seconds)
+//getaddrinfo() does not report the TTL of the records, so it is fixed
+#define DNS_TTL 300
+#define DNS_NEG_TTL 10
+
+//number of buckets in the resolver cache, must be a power of 2,
+//and max number of hosts it keeps
+#define DNS_BUCKETS 256
+#define DNS_MAX_HOSTS 4096
+
+//max number of addresses kept for a host
+#define DNS_MAX_ADDRS 8
+
+struct dc{
+	//a host in the resolver cache.
+	//it records the addresses that (host, port) resolved to, ready to be
+	//passed to connect(), until expires (in microseconds of nowUsec()).
+	//nAddrs is 0 for a negative entry, i.e. a host that did not resolve.
+	//next chains the entries falling into the same bucket of dnsTable.
+
+	char *host;
+	int port;
+	unsigned long hash;
+	unsigned long expires;
+	int nAddrs;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t lens[DNS_MAX_ADDRS];
+	struct dc *next;
+
+};
+
+typedef struct dc dnsEntry;
+
+//the resolver cache, and the mutex protecting it
+dnsEntry *dnsTable[DNS_BUCKETS];
+int dnsHosts = 0;
+pthread_mutex_t dnsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+dnsEntry* findDNS(char *host, int port, unsigned long hash){
+	//look up (host, port) in the resolver cache
+	//we assume that when entering this function, dnsMutex is held
+	dnsEntry *e = dnsTable[hash & (DNS_BUCKETS - 1)];
+	while(e != NULL){
+		if(e->hash == hash && e->port == port && strcmp(e->host, host) == 0){
+			break;
+		}
+		e = e->next;
+	}
+	return e;
+}
+
+int resolveCached(char *host, int port, struct sockaddr_storage *addrs, socklen_t *lens){
+	//look (host, port) up in the resolver cache only, like resolveHost()
+	//return the number of addresses, or -1 if it has no live answer
+	unsigned long hash = hashKey(host, "", port);
+	int n = -1;
+	pthread_mutex_lock(&dnsMutex);
+	dnsEntry *e = findDNS(host, port, hash);
+	if(e != NULL && e->expires > nowUsec()){
+		n = e->nAddrs;
+		memcpy(addrs, e->addrs, n * sizeof(struct sockaddr_storage));
+		memcpy(lens, e->lens, n * sizeof(socklen_t));
+	}
+	pthread_mutex_unlock(&dnsMutex);
+	return n;
+}
+
+int resolveHost(char *host, int port, struct sockaddr_storage *addrs, socklen_t *lens){
+	//resolve (host, port) into at most DNS_MAX_ADDRS addresses, stored in
+	//addrs and lens, and return how many there are (0 if it fails)
+	//answers, including failures, are served from the resolver cache until
+	//they expire, so only the first miss to a host pays for getaddrinfo()
+	unsigned long hash = hashKey(host, "", port);
+	unsigned long now = nowUsec();
+	int i, n = resolveCached(host, port, addrs, lens);
+	if(n >= 0){
+		return n;
+	}
+	n = 0;
+
+	//resolve it without the lock, so a slow lookup holds up no one else
+	struct addrinfo hints, *list, *p;
+	char sP[16];
+	sprintf(sP, "%d", port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if(getaddrinfo(host, sP, &hints, &list) == 0){
+		for(p = list; p != NULL && n < DNS_MAX_ADDRS; p = p->ai_next){
+			memcpy(&addrs[n], p->ai_addr, p->ai_addrlen);
+			lens[n] = p->ai_addrlen;
+			n++;
+		}
+		freeaddrinfo(list);
+	}
+
+	//record the answer, or refresh the expired entry
+	pthread_mutex_lock(&dnsMutex);
+	dnsEntry *e = findDNS(host, port, hash);
+	if(e == NULL && dnsHosts < DNS_MAX_HOSTS){
+		e = malloc(sizeof(dnsEntry));
+		if(e != NULL){
+			e->host = strdup(host);
+			e->port = port;
+			e->hash = hash;
+			e->next = dnsTable[hash & (DNS_BUCKETS - 1)];
+			dnsTable[hash & (DNS_BUCKETS - 1)] = e;
+			dnsHosts++;
+		}
+	}
+	if(e != NULL){
+		e->expires = now + (unsigned long)(n > 0 ? DNS_TTL : DNS_NEG_TTL) * 1000000;
+		e->nAddrs = n;
+		for(i = 0; i < n; i++){
+			e->addrs[i] = addrs[i];
+			e->lens[i] = lens[i];
+		}
+	}
+	pthread_mutex_unlock(&dnsMutex);
+	return n;
+}
+
+void setDeadlines(int fd, int readSecs, int writeSecs){
+	//make a blocking read or write on fd fail once it has waited for
+	//readSecs or writeSecs, so a stalled peer only holds a thread that long
+	//writeSecs also bounds connect()
+	struct timeval tv;
+	tv.tv_sec = readSecs;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	tv.tv_sec = writeSecs;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int openServer(char *host, int port){
+	//connect to (host, port)
+	//return the connected fd, or -1 if it cannot be resolved or reached
+	//unlike Open_clientfd(), failing does not terminate the proxy
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t lens[DNS_MAX_ADDRS];
+	int n = resolveHost(host, port, addrs, lens);
+	int i;
+	for(i = 0; i < n; i++){
+		int fd = socket(addrs[i].ss_family, SOCK_STREAM, 0);
+		if(fd < 0){
+			continue;
+		}
+		setDeadlines(fd, readTimeout, writeTimeout);
+		if(connect(fd, (SA*)&addrs[i], lens[i]) == 0){
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+//how a response body is delimited
+#define BODY_NONE 0	//no body, e.g. 204 and 304
+#define BODY_LENGTH 1	//by Content-Length
+#define BODY_CHUNKED 2	//by chunked transfer coding
+#define BODY_CLOSE 3	//by the server closing the connection
+
+//how this proxy frames a response to the client
+#define FRAME_CLOSE 0	//close the connection after the response
+#define FRAME_KEEP 1	//send the length of the body, and keep the connection
+#define FRAME_CHUNKED 2	//send the body in chunks, and keep the connection
+
+//how long a client connection may stay idle between requests (in seconds)
+#define CLIENT_IDLE_TIMEOUT 10
+
+struct rs{
+	//a response from a server, as it is being read.
+	//head holds its status line and end-to-end headers, each ending with
+	//CRLF. hop-by-hop headers and the framing headers are left out, as
+	//this proxy sends its own framing to the client.
+	//bodyMode tells how the body is delimited, and length is the
+	//Content-Length, -1 if there is none. remaining counts the bytes left
+	//in the body (or in the current chunk), and done is set at its end.
+	//keepAlive is set if the server lets the connection be reused.
+
+	int status;
+	int bodyMode;
+	long length;
+	long remaining;
+	int done;
+	int keepAlive;
+	int headLen;
+	char head[MAX_HEAD_SIZE];
+
+};
+
+typedef struct rs serverResp;
+
+char* headerValue(char *line, char *name){
+	//if line is the header name (case-insensitive), return its value,
+	//with leading spaces skipped; otherwise return NULL
+	int len = strlen(name);
+	if(strncasecmp(line, name, len) != 0 || line[len] != ':'){
+		return NULL;
+	}
+	line += len + 1;
+	while(*line == ' ' || *line == '\t'){
+		line++;
+	}
+	return line;
+}
+
+int isHopByHop(char *line){
+	//whether line is a header that only applies to a single connection,
+	//and must not be forwarded
+	static char *names[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+		"TE", "Trailer", "Upgrade", "Proxy-Authenticate", NULL};
+	int i;
+	for(i = 0; names[i] != NULL; i++){
+		if(headerValue(line, names[i]) != NULL){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//freshness of a response whose server gives none: a tenth of the time
+//since it was last modified, up to HEURISTIC_MAX, or else DEFAULT_TTL
+//(in seconds)
+#define DEFAULT_TTL 300
+#define HEURISTIC_MAX 86400
+
+int headLookup(char *head, int headLen, char *name, char *buf, int size){
+	//find the header name (case-insensitive) among the lines of a kept
+	//head, and copy its value into buf of size bytes, without its CRLF
+	//return the length of the value, -1 if there is no such header
+	char *p = head, *end = head + headLen, *eol;
+	int nameLen = strlen(name);
+	while(p < end && (eol = memchr(p, '\n', end - p)) != NULL){
+		if(eol - p > nameLen && strncasecmp(p, name, nameLen) == 0 && p[nameLen] == ':'){
+			char *v = p + nameLen + 1, *e = eol;
+			while(v < e && (*v == ' ' || *v == '\t')){
+				v++;
+			}
+			while(e > v && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')){
+				e--;
+			}
+			int len = (e - v < size) ? e - v : size - 1;
+			memcpy(buf, v, len);
+			buf[len] = '\0';
+			return len;
+		}
+		p = eol + 1;
+	}
+	return -1;
+}
+
+long httpDate(char *value){
+	//the time of an HTTP date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+	//return -1 if it is not one
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if(end == NULL){
+		return -1;
+	}
+	return (long)timegm(&tm);
+}
+
+int responseFreshness(char *head, int headLen, long now, int useDate, int authorized, long *expires, int *swr){
+	//work out from the Cache-Control, Expires and Last-Modified headers
+	//of a kept head until when the response is fresh, and for how long it
+	//may be served stale while it is revalidated, into *expires and *swr
+	//the Date and Age headers are only used if useDate is set: they are
+	//stale themselves in the head of a cached object
+	//authorized is set if the request carried Authorization: the response
+	//is then only for that client, unless its server says it is public
+	//a response that Vary makes depend on the request headers is not
+	//cached either, as objects are keyed by their URL alone
+	//return -1 if the response must not be cached, 1 if its server said
+	//how long it is fresh, 0 if it is only guessed
+	char value[MAXLINE], directive[MAXLINE];
+	long maxAge = -1, sMaxAge = -1, age = 0, date = now;
+	int noCache = 0, shared = 0;
+	*swr = 0;
+	if(headLookup(head, headLen, "Vary", value, sizeof(value)) > 0){
+		return -1;
+	}
+	if(headLookup(head, headLen, "Cache-Control", value, sizeof(value)) >= 0){
+		char *p, *save;
+		for(p = strtok_r(value, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save)){
+			while(*p == ' ' || *p == '\t'){
+				p++;
+			}
+			long arg = -1;
+			if(sscanf(p, "%[^= ] = %ld", directive, &arg) < 1){
+				continue;
+			}
+			if(strcasecmp(directive, "no-store") == 0 || strcasecmp(directive, "private") == 0){
+				return -1;
+			}
+			else if(strcasecmp(directive, "no-cache") == 0){
+				noCache = 1;
+			}
+			else if(strcasecmp(directive, "max-age") == 0){
+				maxAge = arg;
+			}
+			else if(strcasecmp(directive, "s-maxage") == 0){
+				sMaxAge = arg;
+				shared = 1;
+			}
+			else if(strcasecmp(directive, "public") == 0){
+				shared = 1;
+			}
+			else if(strcasecmp(directive, "stale-while-revalidate") == 0 && arg > 0){
+				*swr = arg;
+			}
+			else if(strcasecmp(directive, "must-revalidate") == 0){
+				noCache |= 2;
+				shared = 1;
+			}
+			else if(strcasecmp(directive, "proxy-revalidate") == 0){
+				noCache |= 2;
+			}
+		}
+	}
+	if(authorized && !shared){
+		return -1;
+	}
+	if(noCache & 2){
+		//it must never be served stale
+		*swr = 0;
+	}
+	if(useDate){
+		long t;
+		if(headLookup(head, headLen, "Date", value, sizeof(value)) >= 0 && (t = httpDate(value)) >= 0){
+			date = t;
+		}
+		if(headLookup(head, headLen, "Age", value, sizeof(value)) >= 0 && atol(value) > 0){
+			age = atol(value);
+		}
+	}
+
+	//as a shared cache, s-maxage comes first, and Expires is taken
+	//relative to the server's clock
+	long ttl;
+	int given = 1;
+	if(noCache & 1){
+		ttl = 0;
+	}
+	else if(sMaxAge >= 0 || maxAge >= 0){
+		ttl = ((sMaxAge >= 0) ? sMaxAge : maxAge) - age;
+	}
+	else if(headLookup(head, headLen, "Expires", value, sizeof(value)) >= 0){
+		long t = httpDate(value);
+		ttl = (t < 0) ? 0 : t - date;
+	}
+	else{
+		long t;
+		given = 0;
+		ttl = DEFAULT_TTL;
+		if(headLookup(head, headLen, "Last-Modified", value, sizeof(value)) >= 0 && (t = httpDate(value)) >= 0){
+			ttl = (date - t) / 10;
+			if(ttl > HEURISTIC_MAX){
+				ttl = HEURISTIC_MAX;
+			}
+		}
+	}
+	*expires = now + ((ttl > 0) ? ttl : 0);
+	return given;
+}
+
+long parseLength(char *value){
+	//parse the value of a Content-Length: digits, then nothing but white
+	//space up to the end of the line
+	//return it, or -1 if it is not a number or does not fit in a long
+	char *end;
+	if(*value < '0' || *value > '9'){
+		return -1;
+	}
+	errno = 0;
+	long length = strtol(value, &end, 10);
+	if(errno == ERANGE){
+		return -1;
+	}
+	while(*end == ' ' || *end == '\t'){
+		end++;
+	}
+	if(*end != '\r' && *end != '\n' && *end != '\0'){
+		return -1;
+	}
+	return length;
+}
+
+int parseRespLine(serverResp *r, char *line, int first){
+	//parse a line of the head of a response into r: the status line if
+	//first is set, a header otherwise. line ends with its CRLF
+	//return -1 if it is ill-formed or the head gets too large
+	//a response whose framing is in doubt, i.e. with a Content-Length
+	//that is not a number, two different ones, or one along with chunked
+	//coding, is ill-formed: it could be read as more than one response
+	char *value;
+	if(first){
+		int major, minor;
+		if(sscanf(line, "HTTP/%d.%d %d", &major, &minor, &r->status) != 3){
+			return -1;
+		}
+		//HTTP/1.1 connections persist unless told otherwise
+		r->keepAlive = (major == 1 && minor >= 1);
+		r->length = -1;
+		r->bodyMode = BODY_CLOSE;
+		r->headLen = 0;
+	}
+	else if((value = headerValue(line, "Content-Length")) != NULL){
+		long length = parseLength(value);
+		if(length < 0 || (r->length >= 0 && r->length != length)){
+			return -1;
+		}
+		r->length = length;
+		return (r->bodyMode == BODY_CHUNKED) ? -1 : 0;
+	}
+	else if((value = headerValue(line, "Transfer-Encoding")) != NULL){
+		if(strcasestr(value, "chunked") != NULL){
+			r->bodyMode = BODY_CHUNKED;
+		}
+		return (r->bodyMode == BODY_CHUNKED && r->length >= 0) ? -1 : 0;
+	}
+	else if((value = headerValue(line, "Connection")) != NULL){
+		if(strcasestr(value, "close") != NULL){
+			r->keepAlive = 0;
+		}
+		else if(strcasestr(value, "keep-alive") != NULL){
+			r->keepAlive = 1;
+		}
+		return 0;
+	}
+	else if(isHopByHop(line)){
+		return 0;
+	}
+
+	//keep the line in the head
+	int len = strlen(line);
+	if(r->headLen + len > MAX_HEAD_SIZE){
+		return -1;
+	}
+	memcpy(r->head + r->headLen, line, len);
+	r->headLen += len;
+	return 0;
+}
+
+void startBody(serverResp *r){
+	//the head of r is complete: find out how its body is delimited
+	if((r->status >= 100 && r->status < 200) || r->status == 204 || r->status == 304){
+		r->bodyMode = BODY_NONE;
+	}
+	else if(r->bodyMode != BODY_CHUNKED && r->length >= 0){
+		r->bodyMode = BODY_LENGTH;
+	}
+	if(r->bodyMode == BODY_CLOSE){
+		r->keepAlive = 0;
+	}
+	r->remaining = (r->bodyMode == BODY_LENGTH) ? r->length : 0;
+	r->done = (r->bodyMode == BODY_NONE || (r->bodyMode == BODY_LENGTH && r->length == 0));
+}
+
+int readRespHead(rio_t *rp, serverResp *r){
+	//read the head of a response from rp into r
+	//interim 1xx responses are skipped
+	//return 0 on success, -1 on error or EOF, -2 if the head came but is
+	//ill-formed, has a line longer than MAXLINE or does not fit in
+	//MAX_HEAD_SIZE: the connection is then out of step, and must not be
+	//reused
+	char line[MAXLINE];
+	do{
+		int first = 1;
+		while(1){
+			ssize_t n = rio_readlineb(rp, line, MAXLINE);
+			if(n <= 0){
+				return -1;
+			}
+			if(line[n - 1] != '\n'){
+				//rio stopped at MAXLINE, or at EOF, inside the line
+				return -2;
+			}
+			if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0){
+				break;
+			}
+			if(parseRespLine(r, line, first) < 0){
+				return -2;
+			}
+			first = 0;
+		}
+		if(first){
+			//no status line at all
+			return -2;
+		}
+	}while(r->status >= 100 && r->status < 200 && r->status != 101);
+	startBody(r);
+	return 0;
+}
+
+ssize_t rioReadSome(rio_t *rp, char *buf, size_t n){
+	//read at most n bytes from rp, without waiting for more than what one
+	//read returns: first whatever rp has buffered, then from its fd
+	if(rp->rio_cnt > 0){
+		if(n > (size_t)rp->rio_cnt){
+			n = rp->rio_cnt;
+		}
+		memcpy(buf, rp->rio_bufptr, n);
+		rp->rio_bufptr += n;
+		rp->rio_cnt -= n;
+		return n;
+	}
+	ssize_t rc;
+	do{
+		rc = read(rp->rio_fd, buf, n);
+	}while(rc < 0 && errno == EINTR);
+	return rc;
+}
+
+int readBody(rio_t *rp, serverResp *r, char *buf, int n){
+	//read the next at most n bytes of the body of r from rp into buf,
+	//with any chunked coding removed
+	//return the number of bytes read, 0 at the end of the body, -1 on error
+	char line[MAXLINE];
+	if(r->done){
+		return 0;
+	}
+	if(r->bodyMode == BODY_CHUNKED && r->remaining == 0){
+		//start the next chunk
+		if(rio_readlineb(rp, line, MAXLINE) <= 0){
+			return -1;
+		}
+		r->remaining = strtol(line, NULL, 16);
+		if(r->remaining <= 0){
+			//the last chunk: skip the trailers, up to the empty line
+			do{
+				if(rio_readlineb(rp, line, MAXLINE) <= 0){
+					return -1;
+				}
+			}while(strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+			r->done = 1;
+			return 0;
+		}
+	}
+	if(r->bodyMode != BODY_CLOSE && n > r->remaining){
+		n = r->remaining;
+	}
+	int rc = rioReadSome(rp, buf, n);
+	if(rc == 0 && r->bodyMode == BODY_CLOSE){
+		r->done = 1;
+		return 0;
+	}
+	if(rc <= 0){
+		//cut short
+		return -1;
+	}
+	if(r->bodyMode != BODY_CLOSE){
+		r->remaining -= rc;
+		if(r->remaining == 0){
+			if(r->bodyMode == BODY_LENGTH){
+				r->done = 1;
+			}
+			else if(rio_readlineb(rp, line, MAXLINE) <= 0){
+				//the CRLF after the data of a chunk
+				return -1;
+			}
+		}
+	}
+	return rc;
+}
+
+int framingHeaders(char *buf, int status, long bodyLen, int frame){
+	//write the framing headers this proxy adds to a response into buf,
+	//and the empty line ending the head: how the body is delimited, i.e.
+	//its length if it is known (bodyLen >= 0) or chunked coding, and
+	//whether the connection to the client is kept, according to frame
+	//return the number of bytes written
+	int n = 0;
+	if(status >= 200 && status != 204 && status != 304){
+		if(frame == FRAME_CHUNKED){
+			n += sprintf(buf + n, "Transfer-Encoding: chunked\r\n");
+		}
+		else if(bodyLen >= 0){
+			n += sprintf(buf + n, "Content-Length: %ld\r\n", bodyLen);
+		}
+	}
+	n += sprintf(buf + n, (frame == FRAME_CLOSE) ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+	return n;
+}
+
+int writevCount(int fd, struct iovec *iov, int cnt){
+	//write all the cnt buffers in iov to fd, retrying on short writes
+	//iov is consumed as it goes
+	//return the number of writev() calls it took, -1 on error
+	int calls = 0;
+	while(cnt > 0){
+		calls++;
+		ssize_t rc = writev(fd, iov, cnt);
+		if(rc < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		while(cnt > 0 && (size_t)rc >= iov->iov_len){
+			rc -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if(cnt > 0){
+			iov->iov_base = (char*)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return calls;
+}
+
+int writevn(int fd, struct iovec *iov, int cnt){
+	//write all the cnt buffers in iov to fd
+	//return 0 on success, -1 on error
+	return (writevCount(fd, iov, cnt) < 0) ? -1 : 0;
+}
+
+void noDelay(int fd){
+	//send what is written to fd at once
+	//a response goes out as a head and then a body: Nagle's algorithm
+	//would hold the body back until the client acks the head, which a
+	//client delaying its acks only does after some 40ms
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int sendRespHead(int fd, char *head, int headLen, int status, long bodyLen, int frame){
+	//write a response head to the client on fd: the kept head, then the
+	//framing headers for a body of bodyLen bytes (-1 if unknown) in frame
+	//return 0 on success, -1 on error
+	char framing[256];
+	struct iovec iov[2];
+	iov[0].iov_base = head;
+	iov[0].iov_len = headLen;
+	iov[1].iov_base = framing;
+	iov[1].iov_len = framingHeaders(framing, status, bodyLen, frame);
+	markFirstByte();
+	return writevn(fd, iov, 2);
+}
+
+int sendBadGateway(int fd, int keepAlive){
+	//answer the client on fd with a 502, for a response from its server
+	//that cannot be relayed, and keep the connection if keepAlive is set
+	//return 0 on success, -1 on error
+	char head[] = "HTTP/1.1 502 Bad Gateway\r\n";
+	return sendRespHead(fd, head, strlen(head), 502, 0, keepAlive ? FRAME_KEEP : FRAME_CLOSE);
+}
+
+int sendBodyPart(int fd, char *buf, int len, int chunked){
+	//write len bytes of a body to the client on fd, as a chunk if chunked
+	//is set; a chunk of 0 bytes is the last one
+	//return 0 on success, -1 on error
+	char size[32];
+	struct iovec iov[3];
+	countBytes(0, len);
+	if(!chunked){
+		return (rio_writen(fd, buf, len) == len) ? 0 : -1;
+	}
+	iov[0].iov_base = size;
+	iov[0].iov_len = sprintf(size, (len > 0) ? "%x\r\n" : "0\r\n\r\n", len);
+	if(len == 0){
+		return writevn(fd, iov, 1);
+	}
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+	return writevn(fd, iov, 3);
+}
+
+//max number of ranges answered in a request: more are served whole
+#define MAX_RANGES 16
+
+//the boundary between the parts of a multipart/byteranges body
+#define RANGE_BOUNDARY "7proxylab3d6b6a416f9b"
+
+//room for the header of each part of a multipart/byteranges body
+#define RANGE_PART_SIZE 320
+
+struct rg{
+	//a range of a body, from byte first to byte last, both included
+
+	long first, last;
+
+};
+
+typedef struct rg byteRange;
+
+struct rr{
+	//the reply to a range request for a cached body, as the pieces to
+	//write: head holds the status line, the kept headers and our own,
+	//parts the header of each part of a multipart body, but for the kept
+	//Content-Type line, which is written from the kept head itself, and
+	//tail its closing boundary. iov points to them and to the ranges of
+	//the body, cnt pieces in order, and bodyBytes counts the bytes of the
+	//body in them
+
+	char head[MAXBUF];
+	char parts[MAX_RANGES][RANGE_PART_SIZE];
+	char tail[64];
+	struct iovec iov[4 * MAX_RANGES + 2];
+	int cnt;
+	long bodyBytes;
+
+};
+
+typedef struct rr rangeReply;
+
+int parseRanges(char *value, long size, byteRange *ranges){
+	//parse value, a Range header, for a body of size bytes into ranges,
+	//each clipped to the body, and at most MAX_RANGES of them
+	//a range past the end of the body is left out
+	//return the number of ranges, 0 if none is satisfiable, or -1 if value
+	//is malformed, not in bytes or asks for too many: it is then ignored
+	if(strncasecmp(value, "bytes=", 6) != 0){
+		return -1;
+	}
+	char *p = value + 6, *end;
+	int n = 0, specs = 0;
+	while(1){
+		long first, last;
+		while(*p == ' ' || *p == '\t'){
+			p++;
+		}
+		if(*p == '-'){
+			//the last bytes of the body
+			if(!isdigit((unsigned char)p[1])){
+				return -1;
+			}
+			long suffix = strtol(p + 1, &end, 10);
+			first = (suffix == 0) ? size : ((suffix < size) ? size - suffix : 0);
+			last = size - 1;
+		}
+		else{
+			if(!isdigit((unsigned char)*p)){
+				return -1;
+			}
+			first = strtol(p, &end, 10);
+			if(*end != '-'){
+				return -1;
+			}
+			p = end + 1;
+			last = size - 1;
+			end = p;
+			if(isdigit((unsigned char)*p)){
+				last = strtol(p, &end, 10);
+				if(last < first){
+					return -1;
+				}
+			}
+		}
+		if(++specs > MAX_RANGES){
+			return -1;
+		}
+		if(first < size){
+			ranges[n].first = first;
+			ranges[n].last = (last < size - 1) ? last : size - 1;
+			n++;
+		}
+
+		p = end;
+		while(*p == ' ' || *p == '\t'){
+			p++;
+		}
+		if(*p == '\0'){
+			return n;
+		}
+		if(*p++ != ','){
+			return -1;
+		}
+	}
+}
+
+int ifRangeHolds(httpRequest *req, char *head, int headLen){
+	//whether the If-Range of req, if it has one, holds for the kept head:
+	//it must be the same strong entity tag, or the same date as the
+	//Last-Modified. if not, the copy of the client has changed, and it is
+	//sent the whole body rather than ranges of it
+	slice *v = requestHeader(req, "If-Range");
+	char want[MAXLINE], have[MAXLINE];
+	if(v == NULL){
+		return 1;
+	}
+	if(sliceCopy(want, sizeof(want), *v) < 0){
+		return 0;
+	}
+	if(want[0] == '"'){
+		return headLookup(head, headLen, "ETag", have, sizeof(have)) >= 0 && strcmp(want, have) == 0;
+	}
+	long date = httpDate(want);
+	return date >= 0 && headLookup(head, headLen, "Last-Modified", have, sizeof(have)) >= 0 && httpDate(have) == date;
+}
+
+int buildRangeReply(rangeReply *rr, httpRequest *req, char *head, int headLen, char *body, long size, int frame){
+	//answer the Range header of req, if it has one, from the kept head and
+	//the body of size bytes of a cached response, into rr, in frame
+	//a single range is answered with a 206 and its Content-Range, several
+	//with a 206 and a multipart/byteranges body, and a Range that none of
+	//the body satisfies with a 416
+	//return 1 if rr holds the reply, 0 if the whole body should be sent
+	//instead: there is no Range, it is ignored, or If-Range fails
+	slice *v = requestHeader(req, "Range");
+	char value[MAXLINE];
+	byteRange ranges[MAX_RANGES];
+	if(v == NULL || sliceCopy(value, sizeof(value), *v) < 0 || !ifRangeHolds(req, head, headLen)){
+		return 0;
+	}
+	int n = parseRanges(value, size, ranges);
+	char *eol = memchr(head, '\n', headLen);
+	char *sp = memchr(head, ' ', headLen);
+	if(n < 0 || eol == NULL || sp == NULL || sp > eol){
+		return 0;
+	}
+
+	//the status line, in the version of the kept one, then the kept
+	//headers, but for the Content-Type line of a multipart body, which
+	//goes in each of its parts, as it is
+	char *type = NULL;
+	int typeLen = 0;
+	int len = sprintf(rr->head, "%.*s %s\r\n", (int)(sp - head), head,
+		(n == 0) ? "416 Range Not Satisfiable" : "206 Partial Content");
+	char *p = eol + 1, *end = head + headLen;
+	while(p < end && (eol = memchr(p, '\n', end - p)) != NULL){
+		if(n < 2 || strncasecmp(p, "Content-Type:", 13) != 0){
+			memcpy(rr->head + len, p, eol + 1 - p);
+			len += eol + 1 - p;
+		}
+		else{
+			type = p;
+			typeLen = eol + 1 - p;
+		}
+		p = eol + 1;
+	}
+
+	rr->cnt = 1;
+	rr->bodyBytes = 0;
+	if(n == 0){
+		len += sprintf(rr->head + len, "Content-Range: bytes */%ld\r\n", size);
+		len += framingHeaders(rr->head + len, 416, 0, frame);
+		countAdd(&getMetrics()->unsatisfiable, 1);
+	}
+	else if(n == 1){
+		rr->bodyBytes = ranges[0].last - ranges[0].first + 1;
+		rr->iov[1].iov_base = body + ranges[0].first;
+		rr->iov[1].iov_len = rr->bodyBytes;
+		rr->cnt = 2;
+		len += sprintf(rr->head + len, "Content-Range: bytes %ld-%ld/%ld\r\n", ranges[0].first, ranges[0].last, size);
+		len += framingHeaders(rr->head + len, 206, rr->bodyBytes, frame);
+		countAdd(&getMetrics()->partial, 1);
+	}
+	else{
+		//each part: its boundary, its headers, and its range of the body
+		//its Content-Range comes first, then the kept Content-Type line
+		//and the empty line ending its headers
+		long total = 0;
+		int i;
+		for(i = 0; i < n; i++){
+			int partLen = sprintf(rr->parts[i], "\r\n--" RANGE_BOUNDARY "\r\nContent-Range: bytes %ld-%ld/%ld\r\n%s",
+				ranges[i].first, ranges[i].last, size, (type != NULL) ? "" : "\r\n");
+			long partBytes = ranges[i].last - ranges[i].first + 1;
+			rr->iov[rr->cnt].iov_base = rr->parts[i];
+			rr->iov[rr->cnt].iov_len = partLen;
+			rr->cnt++;
+			if(type != NULL){
+				rr->iov[rr->cnt].iov_base = type;
+				rr->iov[rr->cnt].iov_len = typeLen;
+				rr->iov[rr->cnt + 1].iov_base = "\r\n";
+				rr->iov[rr->cnt + 1].iov_len = 2;
+				rr->cnt += 2;
+				partLen += typeLen + 2;
+			}
+			rr->iov[rr->cnt].iov_base = body + ranges[i].first;
+			rr->iov[rr->cnt].iov_len = partBytes;
+			rr->cnt++;
+			rr->bodyBytes += partBytes;
+			total += partLen + partBytes;
+		}
+		rr->iov[rr->cnt].iov_base = rr->tail;
+		rr->iov[rr->cnt].iov_len = sprintf(rr->tail, "\r\n--" RANGE_BOUNDARY "--\r\n");
+		total += rr->iov[rr->cnt].iov_len;
+		rr->cnt++;
+		len += sprintf(rr->head + len, "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n");
+		len += framingHeaders(rr->head + len, 206, total, frame);
+		countAdd(&getMetrics()->partial, 1);
+	}
+	rr->iov[0].iov_base = rr->head;
+	rr->iov[0].iov_len = len;
+	return 1;
+}
+
+int sendObject(int connFd, httpRequest *req, int frame, char *head, int headLen, char *body, long size){
+	//write a cached response, the kept head and the body of size bytes,
+	//to connFd in frame: the whole of it, or the ranges req asks for,
+	//if req is not NULL
+	//return 0 on success, -1 on error
+	rangeReply rr;
+	if(req != NULL && buildRangeReply(&rr, req, head, headLen, body, size, frame)){
+		markFirstByte();
+		int rc = writevn(connFd, rr.iov, rr.cnt);
+		countBytes(1, rr.bodyBytes);
+		return rc;
+	}
+	char framing[256];
+	struct iovec iov[3];
+	iov[0].iov_base = head;
+	iov[0].iov_len = headLen;
+	iov[1].iov_base = framing;
+	iov[1].iov_len = framingHeaders(framing, 200, size, frame);
+	iov[2].iov_base = body;
+	iov[2].iov_len = size;
+	markFirstByte();
+	int rc = writevn(connFd, iov, 3);
+	countBytes(1, size);
+	return rc;
+}
+
+int sendCached(cache *thisCache, int connFd, int frame, httpRequest *req){
+	//write the pinned object thisCache to connFd in frame, or the ranges
+	//of it that req asks for, if req is not NULL
+	//the object is pinned rather than locked while it is written, so
+	//a slow client never holds up writers of its shard
+	//return 0 on success, -1 on error
+	return sendObject(connFd, req, frame, thisCache->content, thisCache->headLen,
+		thisCache->content + thisCache->headLen, thisCache->size - thisCache->headLen);
+}
+
+int readCache(char *host, char *path, int port, int connFd, int frame, httpRequest *req, cache **stale){
+	//read the cache
+	//if there is a hit, write it to connFd in frame, or the ranges of it
+	//that req asks for, and return 1, or -1 if writing it failed
+	//otherwise, return 0
+	//a hit past its freshness is served while it is revalidated in the
+	//background if its server allows it. if not, it is a miss, and it
+	//is left pinned in *stale, unless stale is NULL, for the caller to
+	//revalidate it and release it
+
+	cache *thisCache = lookupCache(host, path, port);
+	if(thisCache == NULL){
+		return 0;
+	}
+	int fresh = cacheFreshness(thisCache);
+	if(fresh == STALE){
+		if(stale != NULL){
+			*stale = thisCache;
+		}
+		else{
+			releaseCache(thisCache);
+		}
+		return 0;
+	}
+	if(fresh == STALE_SERVE){
+		countAdd(&getMetrics()->staleServed, 1);
+		startRevalidation(thisCache);
+	}
+	int rc = sendCached(thisCache, connFd, frame, req);
+	releaseCache(thisCache);
+	return (rc == 0) ? 1 : -1;
+}
+
+int readDisk(char *host, char *path, int port, int connFd, int frame, httpRequest *req, cache **stale){
+	//read the disk tier, like readCache() does the memory
+	//a hit is written straight from the mapped segment, and promoted back
+	//to memory, where it is hot again
+	//a stale one is only promoted, and then read from memory, where it is
+	//revalidated like any other
+	//return 1 on a hit, -1 if writing it failed, 0 on a miss
+	diskSegment *seg;
+	diskRecord *rec = lookupDisk(host, path, port, &seg);
+	if(rec == NULL){
+		return 0;
+	}
+	char *head = (char*)(rec + 1) + rec->hostLen + rec->pathLen;
+	if(freshness(rec->expires, rec->swr, time(NULL)) != FRESH){
+		addToCache(host, path, port, head, rec->headLen, head + rec->headLen, rec->bodyLen, rec->expires, rec->swr);
+		unpinSegment(seg);
+		return readCache(host, path, port, connFd, frame, req, stale);
+	}
+	int rc = sendObject(connFd, req, frame, head, rec->headLen, head + rec->headLen, rec->bodyLen);
+	addToCache(host, path, port, head, rec->headLen, head + rec->headLen, rec->bodyLen, rec->expires, rec->swr);
+	unpinSegment(seg);
+	return (rc == 0) ? 1 : -1;
+}
+
+int promoteDisk(char *host, char *path, int port){
+	//promote an object from the disk tier to memory, if it is there
+	//return 1 if it was
+	diskSegment *seg;
+	diskRecord *rec = lookupDisk(host, path, port, &seg);
+	if(rec == NULL){
+		return 0;
+	}
+	char *head = (char*)(rec + 1) + rec->hostLen + rec->pathLen;
+	addToCache(host, path, port, head, rec->headLen, head + rec->headLen, rec->bodyLen, rec->expires, rec->swr);
+	unpinSegment(seg);
+	return 1;
+}
+
+//the path at which a local client gets the counters, e.g. with
+//curl http://localhost:port/stats
+#define STATS_PATH "/stats"
+
+//max number of idle connections kept to a server, and how long one may
+//stay idle in the pool (in seconds)
+#define POOL_MAX_PER_HOST 8
+#define POOL_IDLE_TIMEOUT 30
+
+//number of buckets in the connection pool, must be a power of 2
+#define POOL_BUCKETS 256
+
+struct sc{
+	//a persistent connection to a server.
+	//rio buffers what is read from it, and lives as long as fd does.
+	//while idle, it waits in the bucket of (host, port) in poolTable,
+	//chained by next, since idleSince (in microseconds of nowUsec()).
+	//reused is set once it has served a request.
+
+	int fd;
+	rio_t rio;
+	char *host;
+	int port;
+	unsigned long hash;
+	unsigned long idleSince;
+	int reused;
+	struct sc *next;
+
+};
+
+typedef struct sc serverConn;
+
+//the idle connections to servers, and the mutex protecting them
+serverConn *poolTable[POOL_BUCKETS];
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void closeServerConn(serverConn *sc){
+	//close a connection to a server for good
+	Close(sc->fd);
+	free(sc->host);
+	free(sc);
+}
+
+serverConn* poolAcquire(char *host, int port, int fresh){
+	//get a connection to (host, port): an idle one from the pool, unless
+	//fresh is set, or else a new one
+	//idle connections past POOL_IDLE_TIMEOUT are closed on the way
+	//return NULL if the server cannot be reached
+	unsigned long hash = hashKey(host, "", port);
+	serverConn *sc = NULL;
+	while(!fresh){
+		serverConn *expired = NULL;
+		unsigned long now = nowUsec();
+		pthread_mutex_lock(&poolMutex);
+		serverConn **link = &poolTable[hash & (POOL_BUCKETS - 1)];
+		while(*link != NULL){
+			serverConn *p = *link;
+			if(now - p->idleSince > (unsigned long)POOL_IDLE_TIMEOUT * 1000000){
+				*link = p->next;
+				p->next = expired;
+				expired = p;
+			}
+			else if(sc == NULL && p->hash == hash && p->port == port && strcmp(p->host, host) == 0){
+				*link = p->next;
+				sc = p;
+			}
+			else{
+				link = &p->next;
+			}
+		}
+		pthread_mutex_unlock(&poolMutex);
+		while(expired != NULL){
+			serverConn *next = expired->next;
+			closeServerConn(expired);
+			expired = next;
+		}
+		if(sc == NULL){
+			break;
+		}
+
+		//an idle connection has nothing to read, unless the server closed it
+		char c;
+		if(sc->rio.rio_cnt == 0 && recv(sc->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			sc->reused = 1;
+			return sc;
+		}
+		closeServerConn(sc);
+		sc = NULL;
+	}
+
+	int fd = openServer(host, port);
+	if(fd < 0){
+		return NULL;
+	}
+	sc = malloc(sizeof(serverConn));
+	if(sc == NULL){
+		close(fd);
+		return NULL;
+	}
+	sc->fd = fd;
+	rio_readinitb(&sc->rio, fd);
+	sc->host = strdup(host);
+	sc->port = port;
+	sc->hash = hash;
+	sc->reused = 0;
+	return sc;
+}
+
+void poolRelease(serverConn *sc, int reusable){
+	//give back a connection after a request: keep it idle in the pool if
+	//reusable is set and its server does not have POOL_MAX_PER_HOST idle
+	//connections already, close it otherwise
+	if(reusable){
+		int count = 0;
+		pthread_mutex_lock(&poolMutex);
+		serverConn **bucket = &poolTable[sc->hash & (POOL_BUCKETS - 1)];
+		serverConn *p;
+		for(p = *bucket; p != NULL; p = p->next){
+			if(p->hash == sc->hash && p->port == sc->port && strcmp(p->host, sc->host) == 0){
+				count++;
+			}
+		}
+		if(count < POOL_MAX_PER_HOST){
+			sc->idleSince = nowUsec();
+			sc->next = *bucket;
+			*bucket = sc;
+			sc = NULL;
+		}
+		pthread_mutex_unlock(&poolMutex);
+	}
+	if(sc != NULL){
+		closeServerConn(sc);
+	}
+}
+
+//max number of pieces of a request to a server: the request line, our
+//own headers, the runs of forwarded headers, and the end of the head
+#define REQ_IOV (MAX_HEADERS + 4)
+
+int isConditional(slice name){
+	//whether name is a header making a request conditional
+	static char *names[] = {"If-None-Match", "If-Modified-Since", "If-Match",
+		"If-Unmodified-Since", "If-Range", NULL};
+	int i;
+	for(i = 0; names[i] != NULL; i++){
+		if(sliceIs(name, names[i])){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int wholeRange(httpRequest *req, cache *stale){
+	//whether the request to the server for req should leave out its Range
+	//and If-Range, and fetch the whole object so that it can be cached:
+	//when it revalidates the stale copy, or when the Range asks for the
+	//whole body anyway, "bytes=0-", as players and downloaders start with
+	//the ranges are then answered from the cache
+	slice *v = requestHeader(req, "Range");
+	return v != NULL && (stale != NULL || sliceIs(*v, "bytes=0-"));
+}
+
+int buildRequest(struct iovec *iov, char *own, int ownSize, httpRequest *req, char *path, char *version, char *connection, cache *stale){
+	//build the request for path to the server, for the client's request
+	//req, in iov: the request line, then our own Host, User-Agent and
+	//connection headers, written in own of ownSize bytes, then the client's
+	//headers that are forwarded, straight from its buffer, and the end of
+	//the head. runs of adjacent forwarded lines go in a single piece
+	//if stale is not NULL, the request revalidates it: it is conditional
+	//on the validators of stale instead of those of the client, and req
+	//may be NULL, for a request of our own with no client headers
+	//a Range is forwarded, unless the whole object is fetched instead
+	//return the number of pieces, at most REQ_IOV, or -1 if own is too small
+	char authority[MAXLINE], cond[2 * MAXLINE + 64], value[MAXLINE];
+	char *auth = authority;
+	int authLen, condLen = 0;
+	if(req != NULL){
+		auth = req->host.p;
+		authLen = req->path.p - req->host.p;
+	}
+	else{
+		authLen = snprintf(authority, sizeof(authority), (stale->port == 80) ? "%s" : "%s:%d", stale->host, stale->port);
+	}
+	cond[0] = '\0';
+	if(stale != NULL){
+		if(headLookup(stale->content, stale->headLen, "ETag", value, sizeof(value)) >= 0){
+			condLen += sprintf(cond + condLen, "If-None-Match: %s\r\n", value);
+		}
+		if(headLookup(stale->content, stale->headLen, "Last-Modified", value, sizeof(value)) >= 0){
+			condLen += sprintf(cond + condLen, "If-Modified-Since: %s\r\n", value);
+		}
+	}
+	int len = snprintf(own, ownSize, " %s\r\nHost: %.*s\r\n%sConnection: %s\r\nProxy-Connection: %s\r\n%s",
+		version, authLen, auth, user_agent_hdr, connection, connection, cond);
+	if(len >= ownSize){
+		return -1;
+	}
+	iov[0].iov_base = "GET ";
+	iov[0].iov_len = 4;
+	iov[1].iov_base = path;
+	iov[1].iov_len = strlen(path);
+	iov[2].iov_base = own;
+	iov[2].iov_len = len;
+	int n = 3, i;
+	int whole = (req != NULL) && wholeRange(req, stale);
+	for(i = 0; req != NULL && i < req->nHeaders; i++){
+		if(!forwardHeader(req, i) || (stale != NULL && isConditional(req->names[i]))
+			|| (whole && (sliceIs(req->names[i], "Range") || sliceIs(req->names[i], "If-Range")))){
+			continue;
+		}
+		if(n > 3 && (char*)iov[n - 1].iov_base + iov[n - 1].iov_len == req->lines[i].p){
+			iov[n - 1].iov_len += req->lines[i].len;
+		}
+		else{
+			iov[n].iov_base = req->lines[i].p;
+			iov[n].iov_len = req->lines[i].len;
+			n++;
+		}
+	}
+	iov[n].iov_base = "\r\n";
+	iov[n].iov_len = 2;
+	return n + 1;
+}
+
+int sendRequest(int fd, httpRequest *req, char *path, cache *stale){
+	//write the request for path to the server on fd, for the client's
+	//request req, in a single writev() unless the socket takes it short
+	//if stale is not NULL, it is a request revalidating stale
+	//the connection goes back to the pool after the response
+	//return 0 on success, -1 on error
+	char own[MAXBUF];
+	struct iovec iov[REQ_IOV];
+	int n = buildRequest(iov, own, sizeof(own), req, path, "HTTP/1.1", "keep-alive", stale);
+	if(n < 0){
+		return -1;
+	}
+	int calls = writevCount(fd, iov, n);
+	metrics *m = getMetrics();
+	countAdd(&m->upstreamRequests, 1);
+	countAdd(&m->upstreamCalls, (calls < 0) ? 1 : calls);
+	if(stale != NULL){
+		countAdd(&m->revalidations, 1);
+	}
+	return (calls < 0) ? -1 : 0;
+}
+
+void revalidated(cache *thisCache, serverResp *resp){
+	//the server answered a request revalidating thisCache with the 304
+	//in resp: thisCache is fresh again, for as long as the 304 says, or
+	//else as its own head says, counted from now
+	long expires;
+	int swr;
+	if(responseFreshness(resp->head, resp->headLen, time(NULL), 1, 0, &expires, &swr) <= 0){
+		responseFreshness(thisCache->content, thisCache->headLen, time(NULL), 0, 0, &expires, &swr);
+	}
+	refreshCache(thisCache, expires, swr);
+	countAdd(&getMetrics()->notModified, 1);
+}
+
+void* revalidateThread(void *vargp){
+	//revalidate the objects queued by startRevalidation(), one at a time,
+	//with conditional requests to their servers over the pool
+	//a 304 refreshes an object in place, and a new 200 replaces it
+	Pthread_detach(Pthread_self());
+	char *body = malloc(MAX_OBJECT_SIZE);
+	if(body == NULL){
+		return NULL;
+	}
+	while(1){
+		pthread_mutex_lock(&revalMutex);
+		while(revalCount == 0){
+			pthread_cond_wait(&revalCond, &revalMutex);
+		}
+		cache *thisCache = revalQueue[revalFront];
+		revalFront = (revalFront + 1) % REVAL_QUEUE;
+		revalCount--;
+		pthread_mutex_unlock(&revalMutex);
+
+		serverConn *sc = NULL;
+		serverResp resp;
+		int attempt;
+		for(attempt = 0; attempt < 2 && sc == NULL; attempt++){
+			sc = poolAcquire(thisCache->host, thisCache->port, attempt > 0);
+			if(sc == NULL){
+				break;
+			}
+			if(sendRequest(sc->fd, NULL, thisCache->path, thisCache) < 0 || readRespHead(&sc->rio, &resp) < 0){
+				int reused = sc->reused;
+				poolRelease(sc, 0);
+				sc = NULL;
+				if(!reused){
+					break;
+				}
+			}
+		}
+		if(sc != NULL){
+			int len = 0, srvOk = 1;
+			if(resp.status == 304){
+				revalidated(thisCache, &resp);
+			}
+			else if(resp.status == 200 && resp.length <= MAX_OBJECT_SIZE){
+				//read the new copy whole, and cache it if it fits
+				while(!resp.done && len < MAX_OBJECT_SIZE){
+					int readLen = readBody(&sc->rio, &resp, body + len, MAX_OBJECT_SIZE - len);
+					if(readLen <= 0){
+						srvOk = (readLen == 0);
+						break;
+					}
+					len += readLen;
+				}
+				long expires;
+				int swr;
+				if(srvOk && resp.done
+					&& responseFreshness(resp.head, resp.headLen, time(NULL), 1, 0, &expires, &swr) >= 0){
+					addToCache(thisCache->host, thisCache->path, thisCache->port, resp.head, resp.headLen, body, len, expires, swr);
+				}
+			}
+			poolRelease(sc, srvOk && resp.done && resp.keepAlive);
+		}
+		unpinCache(thisCache, 1);
+	}
+	return NULL;
+}
+
+//size of each of the two buffers of an io_uring relay
+#define RELAY_CHUNK 65536
+
+//user_data tags of io_uring submissions
+#define UR_RECV 1
+#define UR_SEND 2
+#define UR_TIMEOUT 3	//the deadline linked to a recv or send
+
+struct ur{
+	//a minimal io_uring instance, driven through the raw system calls.
+	//the submission and completion rings are mapped from the kernel, and
+	//the pointers below point into those mappings.
+	//bufs are the two relay buffers of the thread owning the ring.
+	//recvTimeout and sendTimeout are the deadlines linked to each recv and
+	//send: a socket polled by the kernel ignores its own timeouts.
+
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	char *bufs[2];
+	struct __kernel_timespec recvTimeout, sendTimeout;
+
+};
+
+typedef struct ur uring;
+
+//whether to relay through io_uring, set by the -u option
+//it covers the relay of the bodies that are not cached, where a request
+//makes a read and a write per chunk; accept and connect are not batched,
+//as a thread of the pool makes one of each per connection, so there is
+//nothing to batch them with. bench -R compares it with the default relay
+int useUring = 0;
+
+//the io_uring of this worker thread, NULL to relay with read and write
+static __thread uring *relayRing = NULL;
+
+int uringAvailable(){
+	//check whether the kernel lets us set up an io_uring
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, 1, &p);
+	if(fd < 0){
+		return 0;
+	}
+	close(fd);
+	return 1;
+}
+
+uring* uringInit(unsigned entries){
+	//set up an io_uring with room for entries submissions
+	//return NULL if the kernel does not support it
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(fd < 0){
+		return NULL;
+	}
+
+	//map the rings, and the array of submission entries
+	size_t sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	char *sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	uring *r = malloc(sizeof(uring));
+	char *bufs = malloc(2 * RELAY_CHUNK);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || r == NULL || bufs == NULL){
+		close(fd);
+		free(r);
+		free(bufs);
+		return NULL;
+	}
+	r->fd = fd;
+	r->sqHead = (unsigned*)(sq + p.sq_off.head);
+	r->sqTail = (unsigned*)(sq + p.sq_off.tail);
+	r->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned*)(sq + p.sq_off.array);
+	r->cqHead = (unsigned*)(cq + p.cq_off.head);
+	r->cqTail = (unsigned*)(cq + p.cq_off.tail);
+	r->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	r->sqes = sqes;
+	r->bufs[0] = bufs;
+	r->bufs[1] = bufs + RELAY_CHUNK;
+	memset(&r->recvTimeout, 0, sizeof(r->recvTimeout));
+	memset(&r->sendTimeout, 0, sizeof(r->sendTimeout));
+	r->recvTimeout.tv_sec = readTimeout;
+	r->sendTimeout.tv_sec = writeTimeout;
+	return r;
+}
+
+struct io_uring_sqe* uringSqe(uring *r){
+	//take the next submission entry, cleared
+	//it is only handed to the kernel by the next uringEnter()
+	unsigned tail = *r->sqTail;
+	unsigned idx = tail & *r->sqMask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqArray[idx] = idx;
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+int uringPrep(uring *r, int op, int fd, char *buf, int len, unsigned long tag){
+	//queue a recv or send of len bytes at buf on fd, tagged with tag,
+	//linked to a timeout that cancels it once its deadline passes
+	//both complete, the timeout with -ETIME if it fired
+	//return the number of entries queued
+	struct io_uring_sqe *sqe = uringSqe(r);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = tag;
+
+	struct io_uring_sqe *timeout = uringSqe(r);
+	timeout->opcode = IORING_OP_LINK_TIMEOUT;
+	timeout->fd = -1;
+	timeout->addr = (unsigned long)((op == IORING_OP_SEND) ? &r->sendTimeout : &r->recvTimeout);
+	timeout->len = 1;
+	timeout->user_data = UR_TIMEOUT;
+	return 2;
+}
+
+int uringEnter(uring *r, unsigned n){
+	//submit the n queued entries and wait for n completions,
+	//all in a single system call
+	int rc;
+	do{
+		rc = syscall(__NR_io_uring_enter, r->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+	}while(rc < 0 && errno == EINTR);
+	return rc;
+}
+
+int uringReap(uring *r, unsigned long *tag){
+	//take a completion off the ring
+	//return its result, and store its tag in *tag
+	unsigned head = *r->cqHead;
+	while(head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)){
+		//not posted yet, which uringEnter() should have waited for
+		if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR){
+			return -1;
+		}
+	}
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+	int res = cqe->res;
+	*tag = cqe->user_data;
+	__atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+	return res;
+}
+
+int uringRelay(uring *r, int fromFd, int toFd, long limit){
+	//relay limit bytes from fromFd to toFd, or everything until EOF if
+	//limit is -1, through io_uring
+	//the two buffers take turns: while one is being sent to toFd, the next
+	//chunk is received into the other, and both are submitted together,
+	//so each chunk costs one system call instead of a read and a write
+	//return 0 at EOF, -1 on error
+	int sendBuf = -1, sendOff = 0, sendLen = 0;
+	int readyBuf = -1, readyLen = 0;
+	int recvBuf = 0;
+	int eof = 0;
+	while(1){
+		//a received chunk is sent as soon as the previous one is done
+		if(sendBuf < 0 && readyBuf >= 0){
+			sendBuf = readyBuf;
+			sendOff = 0;
+			sendLen = readyLen;
+			readyBuf = -1;
+		}
+
+		unsigned n = 0;
+		if(sendBuf >= 0){
+			n += uringPrep(r, IORING_OP_SEND, toFd, r->bufs[sendBuf] + sendOff, sendLen - sendOff, UR_SEND);
+		}
+		if(!eof && readyBuf < 0){
+			recvBuf = (sendBuf == 0) ? 1 : 0;
+			int len = (limit >= 0 && limit < RELAY_CHUNK) ? limit : RELAY_CHUNK;
+			n += uringPrep(r, IORING_OP_RECV, fromFd, r->bufs[recvBuf], len, UR_RECV);
+		}
+		if(n == 0){
+			//EOF, and all sent
+			return 0;
+		}
+		if(uringEnter(r, n) < 0){
+			return -1;
+		}
+
+		while(n-- > 0){
+			unsigned long tag;
+			int res = uringReap(r, &tag);
+			if(tag == UR_TIMEOUT){
+				//the op it is linked to completes on its own, cancelled
+				//if the deadline passed
+				if(res == -ETIME){
+					countAdd(&getMetrics()->timeouts, 1);
+				}
+				continue;
+			}
+			if(res < 0){
+				//drain the other completions before giving up
+				eof = -1;
+				continue;
+			}
+			if(tag == UR_SEND){
+				sendOff += res;
+				countBytes(0, res);
+				if(sendOff == sendLen){
+					sendBuf = -1;
+				}
+			}
+			else if(res == 0){
+				//EOF before limit is cut short
+				eof = (limit > 0) ? -1 : 1;
+			}
+			else{
+				readyBuf = recvBuf;
+				readyLen = res;
+				if(limit >= 0){
+					limit -= res;
+					if(limit == 0){
+						eof = 1;
+					}
+				}
+			}
+		}
+		if(eof < 0){
+			return -1;
+		}
+	}
+}
+
+//max number of bytes moved by a splice() call, i.e. the default capacity of a pipe
+#define SPLICE_CHUNK 65536
+
+//the pipe this thread splices through, created when first needed
+static __thread int splicePipe[2] = {-1, -1};
+
+int* getSplicePipe(){
+	//return the pipe of this thread, or NULL if it cannot be created
+	if(splicePipe[0] < 0 && pipe(splicePipe) < 0){
+		splicePipe[0] = splicePipe[1] = -1;
+		return NULL;
+	}
+	return splicePipe;
+}
+
+void dropSplicePipe(){
+	//close the pipe of this thread, e.g. when bytes are stuck in it
+	close(splicePipe[0]);
+	close(splicePipe[1]);
+	splicePipe[0] = splicePipe[1] = -1;
+}
+
+int spliceRelay(int fromFd, int toFd, long limit){
+	//move limit bytes from fromFd to toFd, or everything until EOF if
+	//limit is -1, with splice() through the pipe of this thread
+	//the bytes go from socket to socket inside the kernel, never through
+	//a buffer of ours
+	//return 0 on success, -1 on error
+	int *p = getSplicePipe();
+	if(p == NULL){
+		return -1;
+	}
+	while(limit != 0){
+		size_t want = (limit >= 0 && limit < SPLICE_CHUNK) ? limit : SPLICE_CHUNK;
+		ssize_t n = splice(fromFd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0){
+			return -1;
+		}
+		if(n == 0){
+			//EOF before limit is cut short
+			return (limit > 0) ? -1 : 0;
+		}
+		if(limit > 0){
+			limit -= n;
+		}
+
+		//drain the pipe into toFd
+		while(n > 0){
+			ssize_t m = splice(p[0], NULL, toFd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(m < 0 && errno == EINTR){
+				continue;
+			}
+			if(m <= 0){
+				dropSplicePipe();
+				return -1;
+			}
+			countBytes(0, m);
+			n -= m;
+		}
+	}
+	return 0;
+}
+
+int relayBody(serverConn *sc, serverResp *r, int connFd, char *buf, int bufLen, int chunked){
+	//relay the rest of the body of r from sc to the client on connFd,
+	//using buf of bufLen bytes for the copies, in chunks if chunked is set
+	//unless the body has to be re-coded, the raw bytes are relayed as they
+	//are: through io_uring if it is enabled, or else spliced
+	//return 0 once all of it is relayed, -1 on error
+	if(r->bodyMode != BODY_CHUNKED && !chunked && (relayRing != NULL || getSplicePipe() != NULL)){
+		//first what rio has buffered
+		//the raw bytes are the body here, only up to remaining for a length
+		long limit = (r->bodyMode == BODY_LENGTH) ? r->remaining : -1;
+		int buffered = sc->rio.rio_cnt;
+		if(limit >= 0 && buffered > limit){
+			buffered = limit;
+		}
+		if(buffered > 0){
+			if(rio_writen(connFd, sc->rio.rio_bufptr, buffered) < 0){
+				return -1;
+			}
+			countBytes(0, buffered);
+			sc->rio.rio_bufptr += buffered;
+			sc->rio.rio_cnt -= buffered;
+			if(limit >= 0){
+				limit -= buffered;
+			}
+		}
+		if(limit != 0){
+			int rc = (relayRing != NULL) ? uringRelay(relayRing, sc->fd, connFd, limit) : spliceRelay(sc->fd, connFd, limit);
+			if(rc < 0){
+				return -1;
+			}
+		}
+		r->remaining = 0;
+		r->done = 1;
+		return 0;
+	}
+
+	int readLen;
+	while((readLen = readBody(&sc->rio, r, buf, bufLen)) > 0){
+		if(sendBodyPart(connFd, buf, readLen, chunked) < 0){
+			return -1;
+		}
+	}
+	if(readLen == 0 && chunked){
+		//the last chunk
+		return sendBodyPart(connFd, buf, 0, 1);
+	}
+	return readLen;
+}
+
+int readRequest(rio_t *rp, httpRequest *r){
+	//read a request from the client on rp, and parse it into r
+	//the head is parsed where rio buffered it, so the slices of r point
+	//into the buffer of rp, and stay valid until the next request is read
+	//a head arriving in pieces is read on into the buffer after what came
+	//before: if that is not at the start of the buffer, it is moved there
+	//first, and parsed again
+	//the whole head is consumed, so a pipelined request can follow
+	//return 0 on success, -1 on error, EOF, idle timeout or a head that
+	//does not fit in the buffer, or takes more than readTimeout to come
+	//a read into a head that has begun waits only for what is left of
+	//readTimeout, and the full readTimeout is restored for the body
+	struct timeval tv;
+	int trimmed = 0;
+	requestInit(r);
+	reqStart = 0;
+	while(1){
+		if(rp->rio_cnt > 0 && reqStart == 0){
+			//the request is timed from here, not while the connection is idle
+			reqStart = nowUsec();
+			reqFirstSent = 0;
+		}
+		int rc = parseRequest(r, rp->rio_bufptr, rp->rio_cnt);
+		if(rc > 0){
+			rp->rio_bufptr += r->headLen;
+			rp->rio_cnt -= r->headLen;
+			if(trimmed){
+				tv.tv_sec = readTimeout;
+				tv.tv_usec = 0;
+				setsockopt(rp->rio_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			}
+			return 0;
+		}
+		if(rc < 0){
+			return -1;
+		}
+
+		//more is needed, after what is buffered
+		if(rp->rio_bufptr != rp->rio_buf){
+			memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+			rp->rio_bufptr = rp->rio_buf;
+			requestInit(r);
+		}
+		if(rp->rio_cnt == sizeof(rp->rio_buf)){
+			return -1;
+		}
+		if(reqStart != 0){
+			unsigned long spent = nowUsec() - reqStart;
+			if(spent >= (unsigned long)readTimeout * 1000000){
+				//a client dribbling its head in
+				countAdd(&getMetrics()->timeouts, 1);
+				return -1;
+			}
+			unsigned long left = (unsigned long)readTimeout * 1000000 - spent;
+			tv.tv_sec = left / 1000000;
+			tv.tv_usec = left % 1000000;
+			setsockopt(rp->rio_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			trimmed = 1;
+		}
+		ssize_t n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			countAdd(&getMetrics()->timeouts, 1);
+			return -1;
+		}
+		if(n <= 0){
+			return -1;
+		}
+		rp->rio_cnt += n;
+	}
+}
+
+//number of buckets in the table of in-flight misses, must be a power of 2
+#define FLIGHT_BUCKETS 256
+
+//stages of an in-flight miss
+#define FLIGHT_HEAD 0	//waiting for the head of the response
+#define FLIGHT_BODY 1	//the body is coming in
+#define FLIGHT_DONE 2	//the whole body is in
+#define FLIGHT_FAILED 3	//it is not shared, or fetching it failed
+
+struct fl{
+	//a miss being fetched from its server, so that concurrent requests
+	//for the same object follow it instead of fetching it again.
+	//the leader, i.e. the request fetching it, publishes the head and then
+	//the body in data as it comes in, len bytes so far, and the followers
+	//stream it from there. data is allocated once, for the largest body
+	//that can be cached, and the bytes below len never change, so
+	//followers send them without holding mutex.
+	//only a response that can be cached is shared: for anything else the
+	//followers go to the server themselves, so a flight never holds more
+	//than MAX_OBJECT_SIZE.
+	//it is linked in flightTable until it is done, chained by next, and
+	//freed with the last of its refCnt references.
+
+	char *host;
+	char *path;
+	int port;
+	unsigned long hash;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stage;
+	int headLen;
+	char head[MAX_HEAD_SIZE];
+	long bodyLen;
+	char *data;
+	int len;
+	int linked;
+	int refCnt;
+	struct fl *next;
+
+};
+
+typedef struct fl flight;
+
+//the in-flight misses, and the mutex protecting the table and refCnt's
+flight *flightTable[FLIGHT_BUCKETS];
+pthread_mutex_t flightMutex = PTHREAD_MUTEX_INITIALIZER;
+
+flight* joinFlight(char *host, char *path, int port, int *leader){
+	//join the flight of (host, path, port) as a follower if there is one,
+	//or else start it as its leader, and set *leader accordingly
+	//return the flight, NULL if it cannot be started
+	unsigned long hash = hashKey(host, path, port);
+	flight **bucket = &flightTable[hash & (FLIGHT_BUCKETS - 1)];
+	flight *f;
+	pthread_mutex_lock(&flightMutex);
+	for(f = *bucket; f != NULL; f = f->next){
+		if(f->hash == hash && f->port == port && strcmp(f->host, host) == 0 && strcmp(f->path, path) == 0){
+			f->refCnt++;
+			pthread_mutex_unlock(&flightMutex);
+			*leader = 0;
+			return f;
+		}
+	}
+	*leader = 1;
+	f = calloc(1, sizeof(flight));
+	if(f != NULL){
+		f->host = strdup(host);
+		f->path = strdup(path);
+		f->port = port;
+		f->hash = hash;
+		pthread_mutex_init(&f->mutex, NULL);
+		pthread_cond_init(&f->cond, NULL);
+		f->stage = FLIGHT_HEAD;
+		f->bodyLen = -1;
+		f->linked = 1;
+		f->refCnt = 1;
+		f->next = *bucket;
+		*bucket = f;
+	}
+	pthread_mutex_unlock(&flightMutex);
+	return f;
+}
+
+void releaseFlight(flight *f){
+	//drop a reference to f, and free it with the last one
+	pthread_mutex_lock(&flightMutex);
+	int last = (--f->refCnt == 0);
+	pthread_mutex_unlock(&flightMutex);
+	if(last){
+		pthread_mutex_destroy(&f->mutex);
+		pthread_cond_destroy(&f->cond);
+		free(f->host);
+		free(f->path);
+		free(f->data);
+		free(f);
+	}
+}
+
+int hasFollowers(flight *f){
+	//whether requests other than the leader follow f
+	pthread_mutex_lock(&flightMutex);
+	int rc = (f->refCnt > 1);
+	pthread_mutex_unlock(&flightMutex);
+	return rc;
+}
+
+void publishFlight(flight *f, int stage, int len){
+	//the leader moves f on to stage, with len bytes of the body in, or as
+	//many as before if len is negative. f may be NULL, for no flight
+	//a finished flight takes no more followers: later requests find the
+	//object in the cache, or fetch it again
+	if(f == NULL){
+		return;
+	}
+	if(stage >= FLIGHT_DONE){
+		pthread_mutex_lock(&flightMutex);
+		if(f->linked){
+			flight **link = &flightTable[f->hash & (FLIGHT_BUCKETS - 1)];
+			while(*link != f){
+				link = &((*link)->next);
+			}
+			*link = f->next;
+			f->linked = 0;
+		}
+		pthread_mutex_unlock(&flightMutex);
+	}
+	pthread_mutex_lock(&f->mutex);
+	if(f->stage < FLIGHT_DONE){
+		f->stage = stage;
+		if(len >= 0){
+			f->len = len;
+		}
+	}
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->mutex);
+}
+
+int followFlight(flight *f, int connFd, int frame){
+	//serve a request by following the flight f led by another request,
+	//sending the response to connFd in frame
+	//a body of unknown length is only sent once it is all in, since it may
+	//yet turn out too large to share
+	//return 1 on success, 0 if it failed after something was sent,
+	//-1 if nothing was sent because f is not shared
+	pthread_mutex_lock(&f->mutex);
+	while(f->stage == FLIGHT_HEAD || (f->stage == FLIGHT_BODY && f->bodyLen < 0)){
+		pthread_cond_wait(&f->cond, &f->mutex);
+	}
+	if(f->stage == FLIGHT_FAILED){
+		pthread_mutex_unlock(&f->mutex);
+		return -1;
+	}
+	long bodyLen = (f->bodyLen >= 0) ? f->bodyLen : f->len;
+	pthread_mutex_unlock(&f->mutex);
+
+	if(sendRespHead(connFd, f->head, f->headLen, 200, bodyLen, frame) < 0){
+		return 0;
+	}
+	int off = 0;
+	while(off < bodyLen){
+		pthread_mutex_lock(&f->mutex);
+		while(f->len == off && f->stage == FLIGHT_BODY){
+			pthread_cond_wait(&f->cond, &f->mutex);
+		}
+		int len = f->len;
+		pthread_mutex_unlock(&f->mutex);
+		if(len == off){
+			//the leader failed before the end
+			return 0;
+		}
+		if(rio_writen(connFd, f->data + off, len - off) < 0){
+			return 0;
+		}
+		countBytes(0, len - off);
+		off = len;
+	}
+	return 1;
+}
+
+int fetchResponse(int connFd, httpRequest *req, char *hostName, char *path, int sendPort, int keepAlive, flight *f, cache *stale){
+	//fetch (hostName, path, sendPort) for req from its server and send the
+	//response to the client on connFd, caching it if it can be
+	//if f is not NULL, this request leads the flight f: the head and the
+	//body are published in it as they arrive, for the followers
+	//if stale is not NULL, it is the pinned stale copy of the object: the
+	//request is conditional on it, and if the server answers that it has
+	//not changed, it is refreshed and served without fetching the body
+	//return 1 if the connection can serve another request, 0 otherwise
+
+	//if not in cache, get a connection to the server: an idle one from
+	//the pool, or a new one. new connections to servers go on concurrently,
+	//and repeated misses to a host reuse its cached addresses
+	serverConn *sc = NULL;
+	serverResp resp;
+	int attempt;
+	for(attempt = 0; attempt < 2 && sc == NULL; attempt++){
+		unsigned long start = nowUsec();
+		sc = poolAcquire(hostName, sendPort, attempt > 0);
+		recordLatency(ST_CONNECT, nowUsec() - start);
+		if(sc == NULL){
+			return 0;
+		}
+		int rc = sendRequest(sc->fd, req, path, stale);
+		if(rc == 0){
+			rc = readRespHead(&sc->rio, &resp);
+		}
+		if(rc < 0){
+			//the server may have closed a pooled connection just as we
+			//picked it up: try once more on a fresh one
+			//a response that came but is ill-formed is not asked again,
+			//the client gets a 502 instead
+			int reused = sc->reused;
+			poolRelease(sc, 0);
+			sc = NULL;
+			if(rc == -2){
+				publishFlight(f, FLIGHT_FAILED, -1);
+				return sendBadGateway(connFd, keepAlive) == 0 && keepAlive;
+			}
+			if(!reused){
+				return 0;
+			}
+		}
+	}
+	if(sc == NULL){
+		return 0;
+	}
+	int frame = keepAlive ? FRAME_KEEP : FRAME_CLOSE;
+	if(stale != NULL && resp.status == 304){
+		//refresh it before letting the flight go: the followers then
+		//find it fresh in the cache
+		revalidated(stale, &resp);
+		publishFlight(f, FLIGHT_FAILED, -1);
+		poolRelease(sc, resp.done && resp.keepAlive);
+		return sendCached(stale, connFd, frame, req) == 0 && keepAlive;
+	}
+
+	//send the head: without a length, the body is chunked for a client
+	//that keeps the connection
+	long bodyLen = (resp.bodyMode == BODY_LENGTH) ? resp.length : -1;
+	if(resp.bodyMode == BODY_NONE){
+		bodyLen = 0;
+	}
+	if(bodyLen < 0 && keepAlive){
+		frame = FRAME_CHUNKED;
+	}
+	int chunked = (frame == FRAME_CHUNKED);
+
+	//stream the body to the client as it arrives, and accumulate it in
+	//fill while it can still be cached, i.e. while it is a 200 within
+	//MAX_OBJECT_SIZE that its server lets us store, for any client,
+	//along with how long it stays fresh. it is only cached once it is complete
+	//a body whose length already says it is too large is not accumulated
+	//at all, it is relayed from the start
+	//when leading a flight, fill is what it shares with the followers,
+	//and then it is the flight's to free
+	char *fill = NULL;
+	int fillLen = 0, swr;
+	long expires;
+	if(resp.status == 200 && bodyLen <= MAX_OBJECT_SIZE
+		&& responseFreshness(resp.head, resp.headLen, time(NULL), 1, requestHeader(req, "Authorization") != NULL, &expires, &swr) >= 0){
+		fill = malloc((bodyLen >= 0) ? bodyLen + 1 : MAX_OBJECT_SIZE);
+	}
+	if(f != NULL && fill != NULL){
+		pthread_mutex_lock(&f->mutex);
+		memcpy(f->head, resp.head, resp.headLen);
+		f->headLen = resp.headLen;
+		f->bodyLen = bodyLen;
+		f->data = fill;
+		pthread_mutex_unlock(&f->mutex);
+		publishFlight(f, FLIGHT_BODY, 0);
+	}
+	else{
+		//nothing to share
+		publishFlight(f, FLIGHT_FAILED, -1);
+	}
+	int ok = sendRespHead(connFd, resp.head, resp.headLen, resp.status, bodyLen, frame) == 0;
+
+	//ok is whether the client side is still fine, srvOk the server side.
+	//once the client is gone, the body is still filled in for followers
+	int srvOk = 1;
+	while(fill != NULL && !resp.done){
+		if(!ok && (f == NULL || !hasFollowers(f))){
+			break;
+		}
+		if(fillLen == MAX_OBJECT_SIZE){
+			//full, but there is more: it cannot be cached!
+			publishFlight(f, FLIGHT_FAILED, -1);
+			if(f == NULL){
+				free(fill);
+			}
+			fill = NULL;
+			break;
+		}
+		int readLen = readBody(&sc->rio, &resp, fill + fillLen, MAX_OBJECT_SIZE - fillLen);
+		if(readLen <= 0){
+			srvOk = (readLen == 0);
+			break;
+		}
+		fillLen += readLen;
+		publishFlight(f, FLIGHT_BODY, fillLen);
+		if(ok){
+			ok = sendBodyPart(connFd, fill + fillLen - readLen, readLen, chunked) == 0;
+		}
+	}
+	if(srvOk && fill != NULL && resp.done){
+		//the whole body is here, add it to cache, and only then let the
+		//flight go, so that later requests find it in the cache
+		addToCache(hostName, path, sendPort, resp.head, resp.headLen, fill, fillLen, expires, swr);
+		publishFlight(f, FLIGHT_DONE, fillLen);
+	}
+	if(f == NULL){
+		free(fill);
+	}
+	ok = ok && srvOk;
+
+	//relay whatever is left
+	if(ok && !resp.done){
+		char buf[RELAY_CHUNK];
+		ok = relayBody(sc, &resp, connFd, buf, sizeof(buf), chunked) == 0;
+	}
+	else if(ok && chunked){
+		//the last chunk
+		ok = sendBodyPart(connFd, NULL, 0, 1) == 0;
+	}
+	poolRelease(sc, srvOk && resp.done && resp.keepAlive);
+	return ok && keepAlive;
+}
+
+int isLocalPeer(int connFd){
+	//whether the client on connFd connects from this host
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	if(getpeername(connFd, (SA*)&peer, &len) < 0){
+		return 0;
+	}
+	if(peer.ss_family == AF_INET){
+		return (ntohl(((struct sockaddr_in*)&peer)->sin_addr.s_addr) >> 24) == 127;
+	}
+	if(peer.ss_family == AF_INET6){
+		struct in6_addr *a = &((struct sockaddr_in6*)&peer)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+	return 0;
+}
+
+int serveStats(int connFd, int keepAlive){
+	//answer a request for the stats endpoint with the counters of the
+	//proxy, as printStats() writes them
+	//return 1 if the connection can serve another request, 0 otherwise
+	char *text = NULL;
+	size_t textLen = 0;
+	FILE *fp = open_memstream(&text, &textLen);
+	if(fp == NULL){
+		return 0;
+	}
+	printStats(fp);
+	fclose(fp);
+	char *head = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+	int ok = sendRespHead(connFd, head, strlen(head), 200, textLen, keepAlive ? FRAME_KEEP : FRAME_CLOSE) == 0
+		&& rio_writen(connFd, text, textLen) == (ssize_t)textLen;
+	free(text);
+	return ok && keepAlive;
+}
+
+int serveObject(int connFd, httpRequest *req, char *hostName, char *path, int sendPort, int keepAlive){
+	//serve the object (hostName, path, sendPort) of req to the client on connFd
+	//check if it is in cache, if it is then simply return it
+	//otherwise connect to the server and wait for response
+	//then send back the response to client
+	//a stale copy found in the cache makes the request to the server
+	//conditional
+	//return 1 if the connection can serve another request, 0 otherwise
+
+	//check if it is already in cache
+	int frame = keepAlive ? FRAME_KEEP : FRAME_CLOSE;
+	cache *stale = NULL;
+	int hit = readCache(hostName, path, sendPort, connFd, frame, req, &stale);
+	if(hit == 0 && stale == NULL){
+		hit = readDisk(hostName, path, sendPort, connFd, frame, req, &stale);
+	}
+	if(hit != 0){
+		//if it is in cache, we are done with it
+		return hit > 0 && keepAlive;
+	}
+
+	//if not, follow the request already fetching it, if any: concurrent
+	//misses for an object make only one request to its server
+	int leader;
+	flight *f = joinFlight(hostName, path, sendPort, &leader);
+	if(f != NULL && !leader){
+		int rc = followFlight(f, connFd, frame);
+		releaseFlight(f);
+		if(rc >= 0){
+			if(stale != NULL){
+				releaseCache(stale);
+			}
+			return rc > 0 && keepAlive;
+		}
+		//the flight could not be shared, but it may have been cached,
+		//or revalidated
+		if(stale != NULL){
+			releaseCache(stale);
+			stale = NULL;
+		}
+		hit = readCache(hostName, path, sendPort, connFd, frame, req, &stale);
+		if(hit != 0){
+			return hit > 0 && keepAlive;
+		}
+		f = NULL;
+	}
+
+	int rc = fetchResponse(connFd, req, hostName, path, sendPort, keepAlive, f, stale);
+	if(f != NULL){
+		//the followers of an unfinished flight fetch it themselves
+		publishFlight(f, FLIGHT_FAILED, -1);
+		releaseFlight(f);
+	}
+	if(stale != NULL){
+		releaseCache(stale);
+	}
+	return rc;
+}
+
+int serveRequest(int connFd, rio_t *rp){
+	//serve a request from the client connected on connFd, read from rp.
+	//first read the client's request, and parse it, then serve it
+	//a local client can ask for the counters at STATS_PATH
+	//return 1 if the connection can serve another request, 0 otherwise
+
+	httpRequest req;
+	if(readRequest(rp, &req) < 0){
+		return 0;
+	}
+	int keepAlive = req.keepAlive;
+	if(sliceEquals(req.method, "GET") && sliceEquals(req.uri, STATS_PATH) && isLocalPeer(connFd)){
+		//not a request to time
+		reqStart = 0;
+		return serveStats(connFd, keepAlive);
+	}
+
+	//if not a GET or bad URL
+	if(!sliceEquals(req.method, "GET") || !req.absolute){
+		return 0;
+	}
+
+	//the host and path are the key of the object: only they are copied
+	//out of the request, as the strings that the cache takes
+	//if path is empty, use a replacement of '/'
+	char hostName[MAXLINE], path[RIO_BUFSIZE];
+	if(sliceCopy(hostName, sizeof(hostName), req.host) < 0 || sliceCopy(path, sizeof(path), req.path) < 0){
+		return 0;
+	}
+	if(path[0] == '\0'){
+		strcpy(path, "/");
+	}
+	recordLatency(ST_PARSE, nowUsec() - reqStart);
+
+	int rc = serveObject(connFd, &req, hostName, path, req.port, keepAlive);
+	if(reqFirstSent){
+		recordLatency(ST_TRANSFER, nowUsec() - reqStart);
+	}
+	countAdd(&getMetrics()->requests, 1);
+	return rc;
+}
+
+//how often an idle client is checked for connections waiting on a thread,
+//in milliseconds
+#define IDLE_CHECK_MS 100
+
+int clientIdle(int connFd){
+	//wait for the next request on the idle connection connFd
+	//a thread idling on a client is wasted while connections wait in
+	//connQ, so the client is given up as soon as one does
+	//return 1 if a request is coming, 0 if the client should be dropped
+	struct pollfd pfd;
+	int waited;
+	pfd.fd = connFd;
+	pfd.events = POLLIN;
+	for(waited = 0; waited < CLIENT_IDLE_TIMEOUT * 1000; waited += IDLE_CHECK_MS){
+		int rc = poll(&pfd, 1, IDLE_CHECK_MS);
+		if(rc > 0){
+			return 1;
+		}
+		if(rc < 0 && errno != EINTR){
+			return 0;
+		}
+		if(__atomic_load_n(&connQ.depth, __ATOMIC_RELAXED) > 0){
+			countAdd(&getMetrics()->idleEvicted, 1);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+void handleClient(int connFd){
+	//process the requests from the client connected on connFd, one after
+	//another, for as long as the client keeps the connection
+	//pipelined requests simply wait in the rio buffer for their turn
+	//an idle connection is dropped after CLIENT_IDLE_TIMEOUT, or earlier
+	//if other connections are waiting for a thread; clientIdle() polls
+	//for that, so the socket itself times reads out after readTimeout
+	//a client that stops reading what is sent to it is dropped after
+	//writeTimeout
+	//the caller closes connFd
+	setDeadlines(connFd, readTimeout, writeTimeout);
+	noDelay(connFd);
+
+        rio_t rioAsServer;
+        rio_readinitb(&rioAsServer, connFd);
+	while(serveRequest(connFd, &rioAsServer)){
+		if(rioAsServer.rio_cnt == 0 && !clientIdle(connFd)){
+			break;
+		}
+	}
+}
+
+void* worker(void *vargp){
+	//a thread of the pool: serve the queued connections one at a time
+	Pthread_detach(Pthread_self());
+
+	//each thread relays through its own ring, if there is io_uring
+	if(useUring){
+		relayRing = uringInit(8);
+	}
+	while(1){
+		int connFd = queueRemove(&connQ);
+		__atomic_add_fetch(&activeConns, 1, __ATOMIC_RELAXED);
+		handleClient(connFd);
+		Close(connFd);
+		__atomic_sub_fetch(&activeConns, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+//states of a connection in the event-driven engine
+#define EV_READ_REQ 0	//reading the request from the client
+#define EV_SEND_HIT 1	//writing a cached object to the client
+#define EV_CONNECT 2	//waiting for the connection to the server
+#define EV_SEND_REQ 3	//writing the request to the server
+#define EV_RELAY 4	//relaying the response from the server to the client
+#define EV_RESOLVE 5	//with a helper, resolving the server
+#define EV_DISK 6	//with a helper, bringing the object back from disk
+#define EV_CLOSED 7	//closed, and freed once the events at hand are done
+
+//max number of chunks relayed for a connection before yielding to others
+#define EV_BUDGET 16
+
+//the response relayed to a client is held in a buffer of EV_RELAY_SIZE
+//bytes: once EV_HIGH_WATER bytes wait in it, reading from the server is
+//paused, until the client has taken all but EV_LOW_WATER of them
+#define EV_RELAY_SIZE 65536
+#define EV_HIGH_WATER 49152
+#define EV_LOW_WATER 16384
+
+//the most of a response that is kept to be cached: a head, and a body
+//of MAX_OBJECT_SIZE, as the threaded engine allows
+#define EV_FILL_MAX (MAX_HEAD_SIZE + MAX_OBJECT_SIZE)
+
+struct ec{
+	//a connection in the event-driven engine, driven by evAdvance().
+	//it owns clientFd and, once connecting, serverFd; both are registered
+	//in the epoll of its loop, with the events in clientEv and serverEv.
+	//req is the request read from the client, parsed into parse as it
+	//arrives, and then the request to send to the server. authorized is
+	//set if it carried Authorization. hit is the pinned object of a cache
+	//hit, and ranges the reply to a range request for it, written from
+	//piece rangeAt on.
+	//buf holds the head of a hit not yet written to the client.
+	//relay holds the response from the server not yet written to the
+	//client, from relayOff to relayLen, and paused is set while it is
+	//above the high watermark; serverDone is set at the server's EOF.
+	//fill accumulates the whole response while it may be cached, in
+	//fillCap bytes grown as it comes.
+	//addrs holds the nAddrs addresses the server resolved to.
+	//start is when the request began to arrive, connStart when the
+	//connection to the server was started, and firstSent whether any of
+	//the response was sent, for the latency histograms.
+	//accepted is when the client connected, and deadline when c is
+	//dropped unless it makes progress; prev and next link the connections
+	//of loop, which checks their deadlines, and jobNext the connections
+	//queued for the helpers or back to their loop.
+
+	int state;
+	int clientFd, serverFd;
+	int clientEv, serverEv;
+	char req[MAXBUF];
+	int reqLen, reqOff;
+	httpRequest parse;
+	char host[MAXBUF], path[MAXBUF];
+	int port;
+	int authorized;
+	cache *hit;
+	int hitOff;
+	rangeReply *ranges;
+	int rangeAt;
+	char buf[MAXBUF];
+	int bufLen, bufOff;
+	char *relay;
+	int relayLen, relayOff;
+	int paused, serverDone;
+	char *fill;
+	int fillLen, fillCap;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t lens[DNS_MAX_ADDRS];
+	int nAddrs;
+	unsigned long start, connStart;
+	int firstSent;
+	unsigned long accepted, deadline;
+	struct el *loop;
+	struct ec *prev, *next, *jobNext;
+
+};
+
+typedef struct ec evConn;
+
+struct el{
+	//an event loop of the event-driven engine.
+	//epFd is its epoll, and wakeFd an eventfd in it, which the helpers
+	//write once they have queued connections on done, under mutex.
+
+	int epFd, wakeFd;
+	evConn *done;
+	pthread_mutex_t mutex;
+
+};
+
+typedef struct el eventLoop;
+
+//the steps of a connection that block, i.e. resolving a server missing
+//from the resolver cache and bringing an object back from the disk tier,
+//whose mapped segments may have to be read in, are left to EV_HELPERS
+//threads: the connection waits in evJobs until one takes it, and is
+//then handed back to its loop
+#define EV_HELPERS 2
+
+evConn *evJobs = NULL, *evJobsLast = NULL;
+pthread_mutex_t evJobMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t evJobCond = PTHREAD_COND_INITIALIZER;
+
+void evHelp(evConn *c){
+	//queue c for the helpers
+	pthread_mutex_lock(&evJobMutex);
+	c->jobNext = NULL;
+	if(evJobsLast != NULL){
+		evJobsLast->jobNext = c;
+	}
+	else{
+		evJobs = c;
+	}
+	evJobsLast = c;
+	pthread_cond_signal(&evJobCond);
+	pthread_mutex_unlock(&evJobMutex);
+}
+
+void* evHelper(void *vargp){
+	//a helper: take the blocking step of each connection queued, and
+	//hand it back to its loop
+	//its loop does not touch it meanwhile
+	Pthread_detach(Pthread_self());
+	while(1){
+		pthread_mutex_lock(&evJobMutex);
+		while(evJobs == NULL){
+			pthread_cond_wait(&evJobCond, &evJobMutex);
+		}
+		evConn *c = evJobs;
+		evJobs = c->jobNext;
+		if(evJobs == NULL){
+			evJobsLast = NULL;
+		}
+		pthread_mutex_unlock(&evJobMutex);
+
+		if(c->state == EV_DISK){
+			promoteDisk(c->host, c->path, c->port);
+		}
+		else{
+			c->nAddrs = resolveHost(c->host, c->port, c->addrs, c->lens);
+		}
+
+		eventLoop *loop = c->loop;
+		pthread_mutex_lock(&loop->mutex);
+		c->jobNext = loop->done;
+		loop->done = c;
+		pthread_mutex_unlock(&loop->mutex);
+		eventfd_write(loop->wakeFd, 1);
+	}
+	return NULL;
+}
+
+void evWatch(int epFd, int fd, void *ptr, int *cur, int events){
+	//set the events that epFd waits for on fd to events
+	//*cur holds the events currently set, -1 if fd is not registered yet
+	if(*cur == events){
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = ptr;
+	epoll_ctl(epFd, (*cur == -1) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+	*cur = events;
+}
+
+void evSent(evConn *c, int n, int fromCache){
+	//n bytes of the response of c were sent to the client
+	if(!c->firstSent){
+		recordLatency(ST_FIRST_BYTE, nowUsec() - c->start);
+		c->firstSent = 1;
+	}
+	countBytes(fromCache, n);
+}
+
+void evClose(evConn *c, evConn **list, evConn **dead){
+	//tear down a connection, and move it from list, the connections of
+	//its loop, to dead: closing the fds also removes them from epoll, but
+	//events for c may still be at hand, so it is freed after them
+	if(c->prev != NULL){
+		c->prev->next = c->next;
+	}
+	else{
+		*list = c->next;
+	}
+	if(c->next != NULL){
+		c->next->prev = c->prev;
+	}
+	if(c->firstSent){
+		recordLatency(ST_TRANSFER, nowUsec() - c->start);
+	}
+	if(c->start != 0){
+		countAdd(&getMetrics()->requests, 1);
+	}
+	__atomic_sub_fetch(&activeConns, 1, __ATOMIC_RELAXED);
+	Close(c->clientFd);
+	if(c->serverFd >= 0){
+		Close(c->serverFd);
+	}
+	if(c->hit != NULL){
+		releaseCache(c->hit);
+	}
+	free(c->ranges);
+	free(c->relay);
+	free(c->fill);
+	c->state = EV_CLOSED;
+	c->next = *dead;
+	*dead = c;
+}
+
+void evDeadline(evConn *c, unsigned long now){
+	//set when c is dropped if it makes no progress from now on
+	//a request has readTimeout to arrive whole from its first byte, and an
+	//idle client CLIENT_IDLE_TIMEOUT to start one; after that, a peer has
+	//writeTimeout to take what we write, and readTimeout to send more
+	if(c->state == EV_READ_REQ){
+		c->deadline = (c->reqLen == 0) ? c->accepted + CLIENT_IDLE_TIMEOUT * 1000000UL
+			: c->start + (unsigned long)readTimeout * 1000000;
+	}
+	else if(((c->clientEv > 0 && (c->clientEv & EPOLLOUT)) || (c->serverEv > 0 && (c->serverEv & EPOLLOUT)))){
+		c->deadline = now + (unsigned long)writeTimeout * 1000000;
+	}
+	else{
+		c->deadline = now + (unsigned long)readTimeout * 1000000;
+	}
+}
+
+int evConnect(evConn *c){
+	//start a non-blocking connection to the server of c, at the first of
+	//its addresses that takes one
+	//return 0 if it is on its way, -1 if it cannot be started
+	int i;
+	for(i = 0; i < c->nAddrs; i++){
+		int fd = socket(c->addrs[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(fd < 0){
+			continue;
+		}
+		if(connect(fd, (SA*)&c->addrs[i], c->lens[i]) == 0 || errno == EINPROGRESS){
+			c->serverFd = fd;
+			c->state = EV_CONNECT;
+			return 0;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+void cacheRawResponse(char *host, char *path, int port, char *raw, int len, int authorized){
+	//cache a whole response of len bytes in raw, as read from a server
+	//that closed the connection after it, for a request that carried
+	//Authorization if authorized is set
+	//only a complete 200 response with a plain body, that its server
+	//lets us store, is cached
+	serverResp r;
+	char line[MAXLINE];
+	int off = 0, first = 1;
+	while(1){
+		char *eol = memchr(raw + off, '\n', len - off);
+		if(eol == NULL || eol - (raw + off) + 1 >= MAXLINE){
+			return;
+		}
+		int lineLen = eol - (raw + off) + 1;
+		memcpy(line, raw + off, lineLen);
+		line[lineLen] = '\0';
+		off += lineLen;
+		if(strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0){
+			break;
+		}
+		if(parseRespLine(&r, line, first) < 0){
+			return;
+		}
+		first = 0;
+	}
+	if(first){
+		return;
+	}
+	startBody(&r);
+	int bodyLen = len - off;
+	long expires;
+	int swr;
+	if(r.status != 200 || r.bodyMode == BODY_CHUNKED || (r.bodyMode == BODY_LENGTH && r.length != bodyLen)
+		|| responseFreshness(r.head, r.headLen, time(NULL), 1, authorized, &expires, &swr) < 0){
+		return;
+	}
+	addToCache(host, path, port, r.head, r.headLen, raw + off, bodyLen, expires, swr);
+}
+
+int evServe(evConn *c){
+	//serve the request of c from the cache if it is a hit, or start
+	//fetching it from the server
+	//return -1 if the request is bad, or the server cannot be reached
+	httpRequest *r = &c->parse;
+	if(c->hit != NULL){
+		//one too stale to serve is fetched again whole rather than
+		//revalidated, as the response is relayed raw: the new copy
+		//replaces it
+		int fresh = cacheFreshness(c->hit);
+		if(fresh == STALE){
+			releaseCache(c->hit);
+			c->hit = NULL;
+		}
+		else if(fresh == STALE_SERVE){
+			countAdd(&getMetrics()->staleServed, 1);
+			startRevalidation(c->hit);
+		}
+	}
+	if(c->hit != NULL && requestHeader(r, "Range") != NULL){
+		//the ranges asked for go out as the pieces of the reply
+		c->ranges = malloc(sizeof(rangeReply));
+		if(c->ranges != NULL && buildRangeReply(c->ranges, r, c->hit->content, c->hit->headLen,
+			c->hit->content + c->hit->headLen, c->hit->size - c->hit->headLen, FRAME_CLOSE)){
+			c->rangeAt = 0;
+			c->state = EV_SEND_HIT;
+			return 0;
+		}
+		free(c->ranges);
+		c->ranges = NULL;
+	}
+	if(c->hit != NULL){
+		//the kept head and our framing go out from buf, then the body
+		memcpy(c->buf, c->hit->content, c->hit->headLen);
+		c->bufLen = c->hit->headLen + framingHeaders(c->buf + c->hit->headLen, 200, c->hit->size - c->hit->headLen, FRAME_CLOSE);
+		c->bufOff = 0;
+		c->hitOff = c->hit->headLen;
+		c->state = EV_SEND_HIT;
+		return 0;
+	}
+
+	//otherwise build the request to the server, as sendRequest() does,
+	//and connect
+	//it is gathered aside, since the slices of the client's request point
+	//into req, then it replaces it, to be written as the socket takes it
+	char own[MAXBUF], out[MAXBUF];
+	struct iovec iov[REQ_IOV];
+	int n = buildRequest(iov, own, sizeof(own), r, c->path, "HTTP/1.0", "close", NULL);
+	int i, len = 0;
+	if(n < 0){
+		return -1;
+	}
+	for(i = 0; i < n; i++){
+		if(len + (int)iov[i].iov_len > (int)sizeof(out)){
+			return -1;
+		}
+		memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	c->reqLen = len;
+	memcpy(c->req, out, c->reqLen);
+	c->reqOff = 0;
+	c->connStart = nowUsec();
+
+	//a server missing from the resolver cache is resolved by a helper
+	c->nAddrs = resolveCached(c->host, c->port, c->addrs, c->lens);
+	if(c->nAddrs < 0){
+		c->state = EV_RESOLVE;
+		return 0;
+	}
+	return evConnect(c);
+}
+
+int evStart(evConn *c){
+	//the request of c has been read and parsed: serve it from the
+	//cache, or start fetching it from the server
+	//return -1 if the request is bad
+	httpRequest *r = &c->parse;
+	if(!sliceEquals(r->method, "GET") || !r->absolute
+		|| sliceCopy(c->host, sizeof(c->host), r->host) < 0 || sliceCopy(c->path, sizeof(c->path), r->path) < 0){
+		return -1;
+	}
+	c->port = r->port;
+	if(c->path[0] == '\0'){
+		strcpy(c->path, "/");
+	}
+	recordLatency(ST_PARSE, nowUsec() - c->start);
+
+	//a miss in memory that is on disk is brought back by a helper first
+	c->authorized = requestHeader(r, "Authorization") != NULL;
+	c->hit = lookupCache(c->host, c->path, c->port);
+	if(c->hit == NULL && onDisk(c->host, c->path, c->port)){
+		c->state = EV_DISK;
+		return 0;
+	}
+	return evServe(c);
+}
+
+int evResume(evConn *c){
+	//go on with c once a helper has taken its step
+	//return -1 if it cannot go on
+	if(c->state == EV_DISK){
+		c->hit = lookupCache(c->host, c->path, c->port);
+		return evServe(c);
+	}
+	return evConnect(c);
+}
+
+int evAdvance(int epFd, evConn *c){
+	//drive c as far as it can go without blocking, then set the events
+	//to wait for before it can go on
+	//return -1 once c is finished, and it should be closed
+	int n, budget = EV_BUDGET;
+	while(1){
+		switch(c->state){
+		case EV_READ_REQ:
+			//read until the end of the headers, or a full buffer
+			n = read(c->clientFd, c->req + c->reqLen, sizeof(c->req) - 1 - c->reqLen);
+			if(n > 0 && c->reqLen == 0){
+				c->start = nowUsec();
+			}
+			if(n < 0 && errno == EAGAIN){
+				evWatch(epFd, c->clientFd, c, &c->clientEv, EPOLLIN);
+				return 0;
+			}
+			if(n <= 0){
+				return -1;
+			}
+			c->reqLen += n;
+			n = parseRequest(&c->parse, c->req, c->reqLen);
+			if(n == 0 && c->reqLen < (int)sizeof(c->req) - 1){
+				break;
+			}
+			if(n <= 0 || evStart(c) < 0){
+				return -1;
+			}
+			break;
+
+		case EV_SEND_HIT:
+			if(c->ranges != NULL){
+				if(c->rangeAt == c->ranges->cnt){
+					//all sent
+					countBytes(1, c->ranges->bodyBytes);
+					return -1;
+				}
+				n = writev(c->clientFd, c->ranges->iov + c->rangeAt, c->ranges->cnt - c->rangeAt);
+			}
+			else if(c->bufOff < c->bufLen){
+				n = write(c->clientFd, c->buf + c->bufOff, c->bufLen - c->bufOff);
+			}
+			else if(c->hitOff < c->hit->size){
+				n = write(c->clientFd, c->hit->content + c->hitOff, c->hit->size - c->hitOff);
+			}
+			else{
+				//all sent
+				return -1;
+			}
+			if(n < 0 && errno == EAGAIN){
+				evWatch(epFd, c->clientFd, c, &c->clientEv, EPOLLOUT);
+				return 0;
+			}
+			if(n <= 0){
+				return -1;
+			}
+			if(c->ranges != NULL){
+				//consume the pieces written
+				struct iovec *iov = c->ranges->iov;
+				while(n > 0 && (size_t)n >= iov[c->rangeAt].iov_len){
+					n -= iov[c->rangeAt].iov_len;
+					c->rangeAt++;
+				}
+				if(n > 0){
+					iov[c->rangeAt].iov_base = (char*)iov[c->rangeAt].iov_base + n;
+					iov[c->rangeAt].iov_len -= n;
+				}
+				evSent(c, 0, 1);
+			}
+			else if(c->bufOff < c->bufLen){
+				c->bufOff += n;
+				evSent(c, 0, 1);
+			}
+			else{
+				c->hitOff += n;
+				evSent(c, n, 1);
+			}
+			break;
+
+		case EV_RESOLVE:
+		case EV_DISK:
+			//hand c to the helpers, and leave its client alone until it
+			//is back
+			if(c->clientEv != -1){
+				epoll_ctl(epFd, EPOLL_CTL_DEL, c->clientFd, NULL);
+				c->clientEv = -1;
+			}
+			evHelp(c);
+			return 0;
+
+		case EV_CONNECT:
+			//connected once it has a peer; a pending error means it failed
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				struct sockaddr_storage peer;
+				socklen_t peerLen = sizeof(peer);
+				getsockopt(c->serverFd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if(err != 0){
+					return -1;
+				}
+				if(getpeername(c->serverFd, (SA*)&peer, &peerLen) < 0){
+					evWatch(epFd, c->clientFd, c, &c->clientEv, 0);
+					evWatch(epFd, c->serverFd, c, &c->serverEv, EPOLLOUT);
+					return 0;
+				}
+			}
+			recordLatency(ST_CONNECT, nowUsec() - c->connStart);
+			c->state = EV_SEND_REQ;
+			break;
+
+		case EV_SEND_REQ:
+			countAdd(&getMetrics()->upstreamCalls, 1);
+			n = write(c->serverFd, c->req + c->reqOff, c->reqLen - c->reqOff);
+			if(n < 0 && errno == EAGAIN){
+				evWatch(epFd, c->serverFd, c, &c->serverEv, EPOLLOUT);
+				return 0;
+			}
+			if(n <= 0){
+				return -1;
+			}
+			c->reqOff += n;
+			if(c->reqOff == c->reqLen){
+				countAdd(&getMetrics()->upstreamRequests, 1);
+				c->relay = malloc(EV_RELAY_SIZE);
+				if(c->relay == NULL){
+					return -1;
+				}
+				c->relayLen = c->relayOff = 0;
+				c->state = EV_RELAY;
+			}
+			break;
+
+		case EV_RELAY:
+			//the server is read from while the client is written to, with
+			//up to EV_RELAY_SIZE bytes in between: past the high watermark
+			//the server is left alone, so a slow client holds it back
+			//instead of filling our memory, until the client catches up
+			{
+				int pending = c->relayLen - c->relayOff;
+				int blocked = 0;
+				if(pending > 0){
+					n = write(c->clientFd, c->relay + c->relayOff, pending);
+					if(n < 0 && errno == EAGAIN){
+						blocked = 1;
+					}
+					else if(n <= 0){
+						return -1;
+					}
+					else{
+						c->relayOff += n;
+						pending -= n;
+						evSent(c, n, 0);
+						if(pending == 0){
+							c->relayLen = c->relayOff = 0;
+						}
+					}
+				}
+				if(c->serverDone && pending == 0){
+					return -1;
+				}
+				if(c->paused && pending <= EV_LOW_WATER){
+					c->paused = 0;
+				}
+				else if(!c->paused && pending >= EV_HIGH_WATER){
+					c->paused = 1;
+				}
+
+				int reading = !c->serverDone && !c->paused;
+				if(reading && budget-- > 0){
+					//make room after what waits, then read
+					if(c->relayOff > 0 && EV_RELAY_SIZE - c->relayLen < MAXBUF){
+						memmove(c->relay, c->relay + c->relayOff, pending);
+						c->relayOff = 0;
+						c->relayLen = pending;
+					}
+					n = read(c->serverFd, c->relay + c->relayLen, EV_RELAY_SIZE - c->relayLen);
+					if(n < 0 && errno != EAGAIN){
+						return -1;
+					}
+					if(n == 0){
+						//the whole response is here, cache it if it fits
+						if(c->fillLen > 0){
+							cacheRawResponse(c->host, c->path, c->port, c->fill, c->fillLen, c->authorized);
+						}
+						c->serverDone = 1;
+						break;
+					}
+					if(n > 0){
+						if(c->fillLen >= 0 && c->fillLen + n > c->fillCap){
+							//grow fill, doubling it up to EV_FILL_MAX; a
+							//response that outgrows that is not cached
+							int cap = (c->fillCap > 0) ? 2 * c->fillCap : EV_RELAY_SIZE;
+							while(cap < c->fillLen + n){
+								cap *= 2;
+							}
+							if(cap > EV_FILL_MAX){
+								cap = EV_FILL_MAX;
+							}
+							char *fill = (c->fillLen + n <= cap) ? realloc(c->fill, cap) : NULL;
+							if(fill == NULL){
+								free(c->fill);
+								c->fill = NULL;
+								c->fillLen = -1;
+							}
+							else{
+								c->fill = fill;
+								c->fillCap = cap;
+							}
+						}
+						if(c->fillLen >= 0){
+							memcpy(c->fill + c->fillLen, c->relay + c->relayLen, n);
+							c->fillLen += n;
+						}
+						c->relayLen += n;
+						break;
+					}
+				}
+				else if(!blocked && pending > 0 && budget-- > 0){
+					//the client takes more
+					break;
+				}
+
+				//wait for whichever side can go on, or yield to the other
+				//connections of this loop once the budget is spent
+				evWatch(epFd, c->clientFd, c, &c->clientEv, (c->relayLen > c->relayOff) ? EPOLLOUT : 0);
+				evWatch(epFd, c->serverFd, c, &c->serverEv, reading ? EPOLLIN : 0);
+				return 0;
+			}
+		}
+	}
+}
+
+void* evLoop(void *vargp){
+	//an event loop of the event-driven engine
+	//it accepts connections on the listening fd in vargp, and drives
+	//every connection it accepted until it is done, or past its deadline
+	//the deadlines are checked about once a second; a connection with
+	//the helpers has none until it is back
+	int listenFd = (int)((long)vargp);
+	eventLoop loop;
+	loop.epFd = epoll_create1(0);
+	loop.wakeFd = eventfd(0, EFD_NONBLOCK);
+	loop.done = NULL;
+	pthread_mutex_init(&loop.mutex, NULL);
+	if(loop.epFd < 0){
+		unix_error("epoll_create1 error");
+	}
+	if(loop.wakeFd < 0){
+		unix_error("eventfd error");
+	}
+	int epFd = loop.epFd;
+
+	//all loops wait on the listening fd, EPOLLEXCLUSIVE wakes up only one
+	//the helpers wake this one up through wakeFd
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if(epoll_ctl(epFd, EPOLL_CTL_ADD, listenFd, &ev) < 0){
+		unix_error("epoll_ctl error");
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop;
+	if(epoll_ctl(epFd, EPOLL_CTL_ADD, loop.wakeFd, &ev) < 0){
+		unix_error("epoll_ctl error");
+	}
+
+	struct epoll_event events[64];
+	evConn *conns = NULL, *dead = NULL;
+	unsigned long lastCheck = nowUsec();
+	while(1){
+		int n = epoll_wait(epFd, events, 64, 1000);
+		unsigned long now = nowUsec();
+		int i;
+		for(i = 0; i < n; i++){
+			evConn *c = events[i].data.ptr;
+			if(events[i].data.ptr == &loop){
+				//go on with the connections back from the helpers
+				eventfd_t cnt;
+				eventfd_read(loop.wakeFd, &cnt);
+				pthread_mutex_lock(&loop.mutex);
+				c = loop.done;
+				loop.done = NULL;
+				pthread_mutex_unlock(&loop.mutex);
+				while(c != NULL){
+					evConn *next = c->jobNext;
+					if(evResume(c) < 0 || evAdvance(epFd, c) < 0){
+						evClose(c, &conns, &dead);
+					}
+					else{
+						evDeadline(c, now);
+					}
+					c = next;
+				}
+				continue;
+			}
+			if(c != NULL){
+				if(c->state == EV_CLOSED){
+					continue;
+				}
+				if(evAdvance(epFd, c) < 0){
+					evClose(c, &conns, &dead);
+				}
+				else{
+					evDeadline(c, now);
+				}
+				continue;
+			}
+
+			//accept whatever is pending
+			int connFd;
+			while((connFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+				c = calloc(1, sizeof(evConn));
+				if(c == NULL){
+					Close(connFd);
+					continue;
+				}
+				__atomic_add_fetch(&activeConns, 1, __ATOMIC_RELAXED);
+				noDelay(connFd);
+				c->clientFd = connFd;
+				c->serverFd = -1;
+				c->clientEv = c->serverEv = -1;
+				c->state = EV_READ_REQ;
+				c->accepted = now;
+				c->loop = &loop;
+				requestInit(&c->parse);
+				c->next = conns;
+				if(conns != NULL){
+					conns->prev = c;
+				}
+				conns = c;
+				if(evAdvance(epFd, c) < 0){
+					evClose(c, &conns, &dead);
+				}
+				else{
+					evDeadline(c, now);
+				}
+			}
+		}
+
+		//drop the connections that stalled
+		if(now - lastCheck >= 1000000){
+			evConn *c = conns;
+			while(c != NULL){
+				evConn *next = c->next;
+				if(now > c->deadline && c->state != EV_RESOLVE && c->state != EV_DISK){
+					countAdd(&getMetrics()->timeouts, 1);
+					evClose(c, &conns, &dead);
+				}
+				c = next;
+			}
+			lastCheck = now;
+		}
+
+		//free the connections closed, now that no event refers to them
+		while(dead != NULL){
+			evConn *next = dead->next;
+			free(dead);
+			dead = next;
+		}
+	}
+	return NULL;
+}
+
+struct sr{
+	//the part of the cache shared by the workers. it is mapped before
+	//they are forked, so it is at the same address in all of them, and
+	//the pointers in it hold in each. the arenas of the shards follow it.
+	//broken is set when a worker died in the middle of updating it:
+	//the supervisor then drops it all
+
+	cacheShard shards[CACHE_SHARDS];
+	arena arenas[CACHE_SHARDS];
+	unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+	unsigned long sketchCount;
+	int broken;
+	workerShare workers[MAX_WORKERS];
+
+};
+
+typedef struct sr sharedRegion;
+
+//the shared region, NULL without workers, and the size of its part
+//before the arenas
+sharedRegion *region = NULL;
+long regionHead = 0;
+
+void sharedReset(){
+	//make the shared region an empty cache, with no worker running
+	//its locks are process-shared, and its mutexes robust: the next
+	//to take one that a dead worker held gets it, and learns of it
+	pthread_mutexattr_t attr;
+	pthread_rwlockattr_t rwAttr;
+	int i;
+	memset(region, 0, offsetof(sharedRegion, workers));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_rwlockattr_init(&rwAttr);
+	pthread_rwlockattr_setpshared(&rwAttr, PTHREAD_PROCESS_SHARED);
+	for(i = 0; i < CACHE_SHARDS; i++){
+		arenaBlock *b = (arenaBlock*)((char*)region + regionHead + (long)i * ARENA_SIZE);
+		b->size = ARENA_SIZE;
+		b->next = NULL;
+		region->arenas[i].free = b;
+		pthread_mutex_init(&region->arenas[i].lock, &attr);
+		pthread_rwlock_init(&region->shards[i].lock, &rwAttr);
+		pthread_mutex_init(&region->shards[i].lruLock, &attr);
+	}
+	pthread_rwlockattr_destroy(&rwAttr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+int sharedInit(){
+	//map the shared region, and move the cache into it
+	//return 0 on success, -1 on error
+	regionHead = (sizeof(sharedRegion) + 4095) & ~4095L;
+	char *map = mmap(NULL, regionHead + (long)CACHE_SHARDS * ARENA_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED){
+		return -1;
+	}
+	region = (sharedRegion*)map;
+	sharedReset();
+	cacheShards = region->shards;
+	arenas = region->arenas;
+	sketch = region->sketch;
+	sketchCount = &region->sketchCount;
+	sharedBroken = &region->broken;
+	return 0;
+}
+
+int openListener(char *port){
+	//open the listening socket on port
+	//a worker opens its own with SO_REUSEPORT, and the kernel spreads the
+	//connections among the workers
+	if(!reusePort){
+		return Open_listenfd(port);
+	}
+	struct addrinfo hints, *list, *p;
+	int fd = -1, on = 1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	if(getaddrinfo(NULL, port, &hints, &list) == 0){
+		for(p = list; p != NULL; p = p->ai_next){
+			if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0
+				&& bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, LISTENQ) == 0){
+				break;
+			}
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(list);
+	}
+	if(fd < 0){
+		fprintf(stderr, "cannot listen on port %s\n", port);
+		exit(1);
+	}
+	return fd;
+}
+
+struct wc{
+	//how the workers are run: n of them, with a share of the disk tier
+	//in dir, of diskMB megabytes, each in a subdirectory of its own.
+	//mask is the signal mask they start with, pids and started their pids
+	//and when they were forked
+
+	int n;
+	char *dir;
+	long diskMB;
+	sigset_t mask;
+	pid_t *pids;
+	time_t *started;
+
+};
+
+typedef struct wc workerConf;
+
+int startWorker(workerConf *w, int id){
+	//fork worker id, with a clean share of the shared region
+	//return 1 in the worker, once it is set up, and 0 in the supervisor
+	workerShare *ws = &region->workers[id];
+	memset(ws, 0, sizeof(workerShare));
+	ws->beat = nowSec();
+	pid_t pid = fork();
+	if(pid != 0){
+		if(pid < 0){
+			fprintf(stderr, "cannot fork worker %d\n", id);
+		}
+		w->pids[id] = pid;
+		w->started[id] = time(NULL);
+		return 0;
+	}
+	//SIGTERM and SIGINT stay blocked: statsThread takes them, to stop
+	//the worker where it holds no lock of the shared region
+	sigset_t mask = w->mask;
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	reusePort = 1;
+	thisWorker = ws;
+	//the supervisor writes the snapshot
+	snapshotPath = NULL;
+	if(w->dir != NULL){
+		char *sub = Malloc(strlen(w->dir) + 16);
+		mkdir(w->dir, 0700);
+		sprintf(sub, "%s/w%d", w->dir, id);
+		if(diskInit(sub, w->diskMB / w->n) < 0){
+			fprintf(stderr, "cannot use %s for the disk tier\n", sub);
+			exit(1);
+		}
+	}
+	return 1;
+}
+
+//how long the workers have to exit once told to stop (in seconds)
+#define WORKER_STOP_WAIT 5
+
+//how long a worker may go without its statsThread running, or stay in a
+//section, before it is taken for hung (in seconds)
+#define WORKER_HANG_WAIT 10
+
+void stopWorkers(workerConf *w){
+	//tell the workers to stop, and wait for them to exit
+	//each exits once it holds no lock of the shared cache. one still
+	//there after WORKER_STOP_WAIT seconds waits on a lock that a dead
+	//worker left held, and would wait for good: it is killed
+	time_t until = time(NULL) + WORKER_STOP_WAIT;
+	pid_t pid;
+	int i, left = 0;
+	for(i = 0; i < w->n; i++){
+		if(w->pids[i] > 0){
+			kill(w->pids[i], SIGTERM);
+			left++;
+		}
+	}
+	while(left > 0 && time(NULL) < until){
+		if((pid = waitpid(-1, NULL, WNOHANG)) == 0){
+			usleep(10000);
+			continue;
+		}
+		if(pid < 0){
+			break;
+		}
+		for(i = 0; i < w->n; i++){
+			if(w->pids[i] == pid){
+				w->pids[i] = 0;
+				left--;
+			}
+		}
+	}
+	for(i = 0; i < w->n; i++){
+		if(w->pids[i] > 0){
+			fprintf(stderr, "worker %d (pid %d) did not stop, killing it\n", i, (int)w->pids[i]);
+			kill(w->pids[i], SIGKILL);
+			w->pids[i] = 0;
+		}
+	}
+	while(wait(NULL) > 0){
+	}
+}
+
+int dropPins(workerShare *ws){
+	//drop the references left by a dead worker, which its pin table
+	//records, and end the revalidations it had started
+	//return how many there were
+	int i, n = 0;
+	for(i = 0; i < WORKER_PINS; i++){
+		if(ws->pins[i] != 0){
+			unpinCache((cache*)(ws->pins[i] & ~1UL), ws->pins[i] & 1);
+			ws->pins[i] = 0;
+			n++;
+		}
+	}
+	return n;
+}
+
+int restartWorkers(workerConf *w){
+	//a worker died in a section, so the shared region may be half updated
+	//and some of its locks held for good: stop the other workers, make
+	//it an empty cache again, warm it up from the last snapshot, and
+	//start them all over
+	//return 1 in the workers, and 0 in the supervisor
+	int i;
+	fprintf(stderr, "the shared cache was left inconsistent, restarting all workers on a new one\n");
+	stopWorkers(w);
+	sharedReset();
+	if(snapshotPath != NULL){
+		loadSnapshot();
+	}
+	for(i = 0; i < w->n; i++){
+		if(startWorker(w, i)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int reapWorkers(workerConf *w){
+	//reap the workers that died, and restart them
+	//one that died in no section left the shared region consistent: only
+	//its references are dropped for it. if one died in a section, all are
+	//restarted on a new region
+	//return 1 in the workers, and 0 in the supervisor
+	pid_t pid;
+	int i, broken = 0;
+	while((pid = waitpid(-1, NULL, WNOHANG)) > 0){
+		for(i = 0; i < w->n && w->pids[i] != pid; i++){
+		}
+		if(i == w->n){
+			continue;
+		}
+		w->pids[i] = 0;
+		if(inSection(&region->workers[i])){
+			fprintf(stderr, "worker %d (pid %d) died in a section of the shared cache\n", i, (int)pid);
+			broken = 1;
+			continue;
+		}
+		if(broken || cacheBroken()){
+			continue;
+		}
+		fprintf(stderr, "worker %d (pid %d) exited, dropped %d references, restarting it\n", i, (int)pid,
+			dropPins(&region->workers[i]));
+		if(time(NULL) - w->started[i] < 1){
+			sleep(1);
+		}
+		if(startWorker(w, i)){
+			return 1;
+		}
+	}
+	if(broken || cacheBroken()){
+		return restartWorkers(w);
+	}
+	return 0;
+}
+
+void checkWorkers(workerConf *w){
+	//kill the workers that hung: the statsThread of one has not run for
+	//WORKER_HANG_WAIT seconds, or one of its threads has been in a section
+	//as long, where it does no I/O, so it waits on a lock for good
+	//reapWorkers() then restarts them
+	long now = nowSec();
+	int i, j;
+	for(i = 0; i < w->n; i++){
+		workerShare *ws = &region->workers[i];
+		int hung = (now - __atomic_load_n(&ws->beat, __ATOMIC_RELAXED) > WORKER_HANG_WAIT);
+		for(j = 0; j < WORKER_LANES; j++){
+			if(__atomic_load_n(&ws->lanes[j].sections, __ATOMIC_RELAXED) > 0
+				&& now - __atomic_load_n(&ws->lanes[j].since, __ATOMIC_RELAXED) > WORKER_HANG_WAIT){
+				hung = 1;
+			}
+		}
+		if(hung && w->pids[i] > 0){
+			fprintf(stderr, "worker %d (pid %d) hung, killing it\n", i, (int)w->pids[i]);
+			kill(w->pids[i], SIGKILL);
+		}
+	}
+}
+
+void superviseWorkers(workerConf *w){
+	//fork the workers, and keep them running: one that dies is replaced,
+	//after a second if it died as soon as it started, and one that hung
+	//is killed and replaced
+	//the supervisor serves nothing: it passes SIGUSR1 on to the workers,
+	//and on SIGTERM or SIGINT it stops them, writes the snapshot of the
+	//shared cache and exits. it also writes it every snapshotInterval
+	//seconds if it is set
+	//it only returns in the workers
+	sigset_t set;
+	struct timespec timeout;
+	int i;
+	long nextSnapshot = nowSec() + snapshotInterval;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &set, &w->mask);
+	w->pids = Calloc(w->n, sizeof(pid_t));
+	w->started = Calloc(w->n, sizeof(time_t));
+	for(i = 0; i < w->n; i++){
+		if(startWorker(w, i)){
+			return;
+		}
+	}
+	timeout.tv_sec = 1;
+	timeout.tv_nsec = 0;
+	while(1){
+		int sig = sigtimedwait(&set, NULL, &timeout);
+		if(sig == SIGCHLD || cacheBroken()){
+			if(reapWorkers(w)){
+				return;
+			}
+		}
+		else if(sig == SIGUSR1){
+			for(i = 0; i < w->n; i++){
+				if(w->pids[i] > 0){
+					kill(w->pids[i], SIGUSR1);
+				}
+			}
+		}
+		else if(sig == SIGTERM || sig == SIGINT){
+			stopWorkers(w);
+			if(snapshotPath != NULL && saveSnapshot() < 0){
+				fprintf(stderr, "cannot write the snapshot to %s\n", snapshotPath);
+			}
+			exit(0);
+		}
+		checkWorkers(w);
+		if(snapshotPath != NULL && snapshotInterval > 0 && nowSec() >= nextSnapshot){
+			saveSnapshot();
+			nextSnapshot = nowSec() + snapshotInterval;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+    //parse the options: the size of the thread pool and of the queue,
+    //or the number of event loops to use the event-driven engine instead
+    //the directory and size of the disk tier, and the eviction policy
+    //of the cache, with or without TinyLFU admission, how often to
+    //dump the counters, the snapshot file and how often to write it, the
+    //number of worker processes sharing the cache, and the read and write
+    //deadlines of sockets
+    int nThreads = DEFAULT_THREADS, queueLen = DEFAULT_QUEUE, nLoops = 0, nWorkers = 0;
+    char *dir = NULL;
+    long diskMB = DEFAULT_DISK_SIZE;
+    int opt;
+    while((opt = getopt(argc, argv, "t:q:e:ud:D:p:ai:s:S:w:r:W:")) != -1){
+	switch(opt){
+	case 'r':
+	    readTimeout = atoi(optarg);
+	    break;
+	case 'W':
+	    writeTimeout = atoi(optarg);
+	    break;
+	case 'w':
+	    nWorkers = atoi(optarg);
+	    break;
+	case 's':
+	    snapshotPath = optarg;
+	    break;
+	case 'S':
+	    snapshotInterval = atoi(optarg);
+	    break;
+	case 'i':
+	    statsInterval = atoi(optarg);
+	    break;
+	case 'p':
+	    cachePolicy = findPolicy(optarg);
+	    if(cachePolicy == NULL){
+		fprintf(stderr, "unknown policy %s, use clock, lru or sieve\n", optarg);
+		return 0;
+	    }
+	    break;
+	case 'a':
+	    useAdmission = 1;
+	    break;
+	case 'd':
+	    dir = optarg;
+	    break;
+	case 'D':
+	    diskMB = atol(optarg);
+	    break;
+	case 'u':
+	    useUring = 1;
+	    break;
+	case 'e':
+	    nLoops = atoi(optarg);
+	    break;
+	case 't':
+	    nThreads = atoi(optarg);
+	    break;
+	case 'q':
+	    queueLen = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s [-t threads] [-q queue] [-e loops] [-u] [-d dir] [-D disk MB] [-p policy] [-a] [-i stats interval] [-s snapshot] [-S snapshot interval] [-w workers] [-r read timeout] [-W write timeout] port\n", argv[0]);
+	    return 0;
+	}
+    }
+
+    //if no port is specified, return
+    if(optind >= argc){
+	printf("Must specify a port number!\n");
+	return 0;
+    }
+    if(nThreads < 1 || queueLen < 1 || nLoops < 0 || nWorkers < 0){
+	fprintf(stderr, "thread, queue, loop and worker counts must be positive\n");
+	return 0;
+    }
+    if(nWorkers > MAX_WORKERS){
+	fprintf(stderr, "at most %d workers\n", MAX_WORKERS);
+	return 0;
+    }
+    if(readTimeout < 1 || writeTimeout < 1){
+	fprintf(stderr, "timeouts must be at least a second\n");
+	return 0;
+    }
+
+    //first initialize locks, or the shared region, which has its own,
+    //when there are workers
+    pthread_t tid;
+    int i;
+    if(nWorkers > 0){
+	if(sharedInit() < 0){
+	    fprintf(stderr, "cannot map the shared cache\n");
+	    return 0;
+	}
+    }
+    else{
+	for(i = 0; i < CACHE_SHARDS; i++){
+	    pthread_rwlock_init(&cacheShards[i].lock, NULL);
+	    pthread_mutex_init(&cacheShards[i].lruLock, NULL);
+	}
+    }
+    Signal(SIGPIPE, SIG_IGN);
+    if(dir != NULL && nWorkers == 0 && diskInit(dir, diskMB) < 0){
+	fprintf(stderr, "cannot use %s for the disk tier\n", dir);
+	return 0;
+    }
+
+    //warm the cache up from the snapshot of the last run
+    if(snapshotPath != NULL){
+	unsigned long start = nowUsec();
+	int n = loadSnapshot();
+	if(n >= 0){
+	    fprintf(stderr, "loaded %d objects from %s in %lu us\n", n, snapshotPath, nowUsec() - start);
+	}
+    }
+
+    //with workers, this process only supervises them, and each of them
+    //goes on from here on its own listening socket
+    if(nWorkers > 0){
+	workerConf w;
+	w.n = nWorkers;
+	w.dir = dir;
+	w.diskMB = diskMB;
+	superviseWorkers(&w);
+    }
+
+    //SIGUSR1 dumps the counters, and SIGTERM and SIGINT write the
+    //snapshot or stop a worker, they are taken by statsThread only
+    sigset_t statsSet;
+    sigemptyset(&statsSet);
+    sigaddset(&statsSet, SIGUSR1);
+    if(snapshotPath != NULL || reusePort){
+	sigaddset(&statsSet, SIGTERM);
+	sigaddset(&statsSet, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &statsSet, NULL);
+    Pthread_create(&tid, NULL, statsThread, NULL);
+    if(snapshotPath != NULL && snapshotInterval > 0){
+	Pthread_create(&tid, NULL, snapshotThread, NULL);
+    }
+
+    //stale objects served under stale-while-revalidate are refreshed by
+    //these threads, so no client waits on their servers
+    for(i = 0; i < REVAL_THREADS; i++){
+	Pthread_create(&tid, NULL, revalidateThread, NULL);
+    }
+
+    //the event-driven engine: the loops share a non-blocking listening fd,
+    //and this thread runs the last one
+    if(nLoops > 0){
+	int listenFd = openListener(argv[optind]);
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+	for(i = 1; i < nLoops; i++){
+	    Pthread_create(&tid, NULL, evLoop, (void*)((long)listenFd));
+	}
+	for(i = 0; i < EV_HELPERS; i++){
+	    Pthread_create(&tid, NULL, evHelper, NULL);
+	}
+	evLoop((void*)((long)listenFd));
+	return 0;
+    }
+
+    //check that io_uring is there, or fall back to read and write
+    if(useUring && !uringAvailable()){
+	fprintf(stderr, "io_uring unavailable, relaying with read and write\n");
+	useUring = 0;
+    }
+
+    //prethread the pool
+    queueInit(&connQ, queueLen);
+    for(i = 0; i < nThreads; i++){
+	Pthread_create(&tid, NULL, worker, NULL);
+    }
 
     //the listening port
-    int listenFd = Open_listenfd(argv[1]), connFd;
+    int listenFd = openListener(argv[optind]), connFd;
     
     struct sockaddr_in clientAddr;
     socklen_t clientLen = sizeof(clientAddr);
@@ -394,8 +5699,8 @@ int main(int argc, char **argv)
         clientLen = sizeof(clientAddr);
         connFd = Accept(listenFd, (SA*)(&clientAddr), &clientLen);
 
-        //create the actual processing thread
-	Pthread_create(&tid, NULL, thread, (void*)((long)connFd));
+        //hand it to the pool, waiting while the queue is full
+	queueInsert(&connQ, connFd);
 
     }
     return 0;